@@ -0,0 +1,419 @@
+#include "ai.h"
+#include "body.h"
+#include "sse.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <print>
+#include <ranges>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// every allocation in the process goes through here so runs can report allocations per event
+std::atomic<std::size_t> allocations = 0;
+std::atomic<std::size_t> largest_allocation = 0;
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    for (auto largest = largest_allocation.load(std::memory_order_relaxed); size > largest;)
+        if (largest_allocation.compare_exchange_weak(largest, size, std::memory_order_relaxed))
+            break;
+    if (auto ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+enum class shape
+{
+    text,    // plain markdown answer
+    reworder // reworder::schema() JSON built up token by token
+};
+
+std::string_view to_string(shape s)
+{
+    return s == shape::text ? "text" : "reworder";
+}
+
+// the raw (unescaped) text of each delta
+std::vector<std::string> make_tokens(std::size_t count, shape s)
+{
+    constexpr std::array words{"The", " quick", " brown", " fox", " jumps", " over", " the", " lazy", " dog", ".\n", " \"Quoted\"", " naïve", " **bold**"};
+
+    std::vector<std::string> tokens;
+    tokens.reserve(count);
+
+    if (s == shape::text)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+            tokens.emplace_back(words[i % words.size()]);
+        return tokens;
+    }
+
+    // {"improved":"...","explanation":"..."}, escaped as the model would stream it
+    auto escaped = [](std::string_view word) {
+        auto res = nlohmann::json(word).dump();
+        return res.substr(1, res.size() - 2);
+    };
+
+    std::size_t body = count > 6 ? count - 6 : 0;
+    tokens.emplace_back("{\"");
+    tokens.emplace_back("improved\":\"");
+    for (std::size_t i = 0; i < body / 2; ++i)
+        tokens.push_back(escaped(words[i % words.size()]));
+    tokens.emplace_back("\",\"");
+    tokens.emplace_back("explanation\":\"");
+    for (std::size_t i = body / 2; i < body; ++i)
+        tokens.push_back(escaped(words[i % words.size()]));
+    tokens.emplace_back("\"");
+    tokens.emplace_back("}");
+    return tokens;
+}
+
+// synthetic Responses stream with one delta event per token
+std::string make_stream(const std::vector<std::string> &tokens)
+{
+    std::string res;
+    res += "event: response.created\n"
+           "data: {\"type\":\"response.created\",\"sequence_number\":0,\"response\":{\"id\":\"resp_bench\",\"object\":\"response\",\"created_at\":1750000000,\"status\":\"in_progress\"}}\n\n";
+
+    for (std::size_t i = 0; i < tokens.size(); ++i)
+        res += std::format("event: response.output_text.delta\n"
+                           "data: {{\"type\":\"response.output_text.delta\",\"sequence_number\":{},\"item_id\":\"msg_bench\",\"output_index\":0,\"content_index\":0,\"delta\":{},\"logprobs\":[]}}\n\n",
+                           i + 1, nlohmann::json(tokens[i]).dump());
+
+    res += std::format("event: response.output_text.done\n"
+                       "data: {{\"type\":\"response.output_text.done\",\"sequence_number\":{},\"item_id\":\"msg_bench\",\"output_index\":0,\"content_index\":0,\"text\":\"\"}}\n\n",
+                       tokens.size() + 1);
+    return res;
+}
+
+template <typename Fn>
+double time_ms(Fn &&fn, int iterations)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        fn();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+// repeats fn until it has run for at least min_ms, returns the time of one run
+template <typename Fn>
+double time_adaptive_ms(Fn &&fn, double min_ms = 50)
+{
+    for (int iterations = 1;; iterations *= 2)
+    {
+        auto ms = time_ms(fn, iterations);
+        if (ms * iterations >= min_ms || iterations >= 1 << 16)
+            return ms;
+    }
+}
+
+void bench_scanner(std::string_view stream)
+{
+    std::println("SSE scanner ({} bytes, best available: {})", stream.size(), ai::detail::to_string(ai::detail::simd_support()));
+
+    for (auto level : {ai::detail::simd_t::scalar, ai::detail::simd_t::sse2, ai::detail::simd_t::avx2})
+    {
+        if (level > ai::detail::simd_support())
+            continue;
+        ai::detail::set_simd(level);
+
+        for (std::size_t chunk : {std::size_t(128), stream.size()})
+        {
+            std::size_t blocks = 0, fields = 0;
+            auto ms = time_ms([&] {
+                ai::detail::sse_framer framer;
+                for (std::size_t pos = 0; pos < stream.size(); pos += chunk)
+                    framer.feed(stream.substr(pos, chunk), [&](const ai::detail::sse_block &block) {
+                        ++blocks;
+                        fields += block.event_field.size + block.data_field.size;
+                        return true;
+                    });
+            }, 20);
+
+            std::println("  {:<6} chunk {:>9}: {:9.1f} MB/s ({} blocks)", ai::detail::to_string(level), chunk, stream.size() / (ms * 1000), blocks / 20);
+        }
+    }
+
+    ai::detail::set_simd(ai::detail::simd_support());
+}
+
+void bench_delta(std::string_view stream)
+{
+    std::vector<std::string> payloads;
+    ai::detail::sse_framer framer;
+    framer.feed(stream, [&](const ai::detail::sse_block &block) {
+        if (block.event() == "response.output_text.delta")
+            payloads.emplace_back(block.data());
+        return true;
+    });
+
+    if (payloads.empty())
+        return;
+
+    std::println("Delta extraction ({} tokens)", payloads.size());
+
+    std::string accum;
+    auto dom_ms = time_ms([&] {
+        accum.clear();
+        for (auto &data : payloads)
+        {
+            auto j = nlohmann::json::parse(data);
+            if (j.contains("delta"))
+            {
+                std::string ds = j["delta"];
+                accum.append(ds);
+            }
+        }
+    }, 5);
+    auto dom_size = accum.size();
+
+    std::size_t fallbacks = 0;
+    auto fast_ms = time_ms([&] {
+        accum.clear();
+        fallbacks = 0;
+        for (auto &data : payloads)
+            if (ai::detail::delta_fields fields; !ai::detail::extract_delta(data, accum, fields))
+                ++fallbacks;
+    }, 5);
+
+    if (accum.size() != dom_size)
+        std::print(std::cerr, "Extracted text differs: {} vs {} bytes\n", accum.size(), dom_size);
+
+    std::println("  json DOM:  {:12.0f} tokens/s", payloads.size() / (dom_ms / 1000));
+    std::println("  extractor: {:12.0f} tokens/s ({} fallbacks)", payloads.size() / (fast_ms / 1000), fallbacks);
+}
+
+// raw_stream::parse over every combination of shape, length and chunk size
+void bench_raw_stream(std::span<const std::size_t> lengths, std::span<const std::size_t> chunks)
+{
+    std::println("raw_stream::parse");
+    std::println("  {:<8} {:>7} {:>6} {:>10} {:>9} {:>11} {:>12}", "shape", "tokens", "chunk", "MB/s", "ns/byte", "ns/event", "allocs/event");
+
+    for (auto s : {shape::text, shape::reworder})
+        for (auto length : lengths)
+        {
+            auto stream = make_stream(make_tokens(length, s));
+            auto events = length + 2;
+
+            for (auto chunk : chunks)
+            {
+                ai::detail::raw_stream raw;
+                std::size_t deltas = 0;
+                raw.delta = [&](std::string_view, std::string_view) { ++deltas; };
+
+                auto run = [&] {
+                    raw.clear();
+                    for (std::size_t pos = 0; pos < stream.size(); pos += chunk)
+                        raw.parse(std::string_view(stream).substr(pos, chunk));
+                };
+
+                run(); // warm up buffers
+                auto before = allocations.load();
+                run();
+                auto allocs = allocations.load() - before;
+
+                auto ms = time_adaptive_ms(run);
+                auto ns = ms * 1e6;
+
+                std::println("  {:<8} {:>7} {:>6} {:>10.1f} {:>9.2f} {:>11.1f} {:>12.3f}",
+                             to_string(s), length, chunk, stream.size() / (ms * 1000), ns / stream.size(), ns / events, double(allocs) / events);
+            }
+        }
+}
+
+// json_stream_handler::parse re-parses the whole accumulated answer on every delta, so its cost per delta grows
+// with the position in the answer. Sampled at evenly spaced positions rather than run to completion.
+void bench_json_handler(std::span<const std::size_t> lengths)
+{
+    constexpr std::size_t samples = 32;
+
+    std::println("json_stream_handler::parse (reworder shape, {} samples per length)", samples);
+    std::println("  {:>7} {:>14} {:>14} {:>14} {:>12}", "tokens", "first ns", "last ns", "mean ns/delta", "allocs/delta");
+
+    auto handler = ai::json_stream_handler::make({});
+    std::size_t failures = 0;
+    auto parse = [&](std::string_view accum) {
+        try
+        {
+            handler->parse(accum);
+        }
+        catch (const std::exception &)
+        {
+            ++failures;
+        }
+    };
+
+    for (auto length : lengths)
+    {
+        auto tokens = make_tokens(length, shape::reworder);
+
+        std::vector<std::size_t> prefix;
+        prefix.reserve(tokens.size());
+        std::string accum;
+        for (auto &token : tokens)
+        {
+            accum += token;
+            prefix.push_back(accum.size());
+        }
+
+        double first = 0, last = 0, total = 0;
+        std::size_t allocs = 0;
+        for (std::size_t i = 0; i < samples; ++i)
+        {
+            auto at = (tokens.size() - 1) * i / (samples - 1);
+            std::string_view view = std::string_view(accum).substr(0, prefix[at]);
+
+            auto before = allocations.load();
+            parse(view);
+            allocs += allocations.load() - before;
+
+            auto ns = time_adaptive_ms([&] { parse(view); }, 5) * 1e6;
+            if (i == 0)
+                first = ns;
+            last = ns;
+            total += ns;
+        }
+
+        std::println("  {:>7} {:>14.0f} {:>14.0f} {:>14.0f} {:>12.1f}", length, first, last, total / samples, double(allocs) / samples);
+    }
+
+    if (failures)
+        std::print(std::cerr, "{} partial documents failed to parse\n", failures);
+}
+
+// handing the accumulated answer to another thread on every delta: copying accum vs queueing a text_snapshot
+void bench_delivery(std::size_t length)
+{
+    std::println("Delta delivery ({} tokens, text shape)", length);
+
+    auto stream = make_stream(make_tokens(length, shape::text));
+
+    auto run = [&](bool shared) {
+        ai::detail::raw_stream raw;
+        std::size_t copied = 0;
+        std::vector<ai::text_snapshot> snapshots;
+        snapshots.reserve(length);
+        if (shared)
+            raw.shared_delta = [&](const ai::text_snapshot &accum, std::string_view) { snapshots.push_back(accum); };
+        else
+            raw.delta = [&](std::string_view accum, std::string_view) {
+                std::string copy(accum); // what make_callback used to queue
+                copied += copy.size();
+            };
+
+        auto before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        raw.parse(stream);
+        auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        auto allocs = allocations.load() - before;
+
+        copied += raw.shared_accum.size();
+
+        std::println("  {:<9} {:10.1f} ms {:14} bytes copied {:10} allocs", shared ? "snapshot" : "copy", ms, copied, allocs);
+    };
+
+    run(false);
+    run(true);
+}
+
+void bench_body(std::size_t size)
+{
+    std::println("Request body ({} KB text attachment)", size / 1024);
+
+    std::string attachment;
+    attachment.reserve(size);
+    for (std::size_t i = 0; attachment.size() < size; ++i)
+        attachment += std::format("line {} of the \"attachment\"\twith some text to escape\n", i);
+
+    ai::input_t input{{ai::input_t::role::user, ai::input_content{"Summarize this file.", attachment}}};
+    nlohmann::json request = {{"stream", true}, {"model", "gpt-4.1"}, {"instructions", "Be brief."}};
+
+    auto run = [&](bool streamed) {
+        largest_allocation = 0;
+        auto before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+
+        std::size_t sent = 0;
+        if (streamed)
+        {
+            auto head = request.dump();
+            ai::detail::body_writer body(head, {}, input);
+            std::array<char, 65536> buffer; // libcurl's upload buffer
+            while (auto n = body.read(buffer.data(), buffer.size()))
+                sent += n;
+        }
+        else
+        {
+            auto copy = request; // what send used to build
+            copy["input"] = input.json();
+            sent = copy.dump().size();
+        }
+
+        auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::println("  {:<9} {:10.1f} ms {:14} bytes sent {:10} allocs {:12} bytes largest block", streamed ? "streamed" : "dump", ms, sent, allocations.load() - before, largest_allocation.load());
+    };
+
+    run(false);
+    run(true);
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        auto args = std::ranges::subrange(argv + 1, argv + argc) | std::views::transform([](auto &&arg) { return std::string_view(arg); });
+
+        // optionally bench the scanner against a recorded stream
+        std::string stream;
+        if (auto it = std::ranges::find(args, "--file"); it != args.end() && std::ranges::next(it) != args.end())
+        {
+            std::ifstream file(std::string(*std::ranges::next(it)), std::ios::binary);
+            if (!file)
+            {
+                std::print(std::cerr, "Failed to open {}\n", *std::ranges::next(it));
+                return 1;
+            }
+            stream = (std::ostringstream() << file.rdbuf()).str();
+        }
+        else
+            stream = make_stream(make_tokens(20000, shape::text));
+
+        // 100 to 100k tokens, 1 byte to 64 KB chunks; --quick stops at 1k tokens
+        constexpr std::array<std::size_t, 4> lengths{100, 1000, 10000, 100000};
+        constexpr std::array<std::size_t, 6> chunks{1, 16, 128, 1024, 16384, 65536};
+        auto used_lengths = std::span(lengths).first(std::ranges::contains(args, "--quick") ? 2 : lengths.size());
+
+        bench_scanner(stream);
+        bench_delta(stream);
+        bench_raw_stream(used_lengths, chunks);
+        bench_json_handler(used_lengths);
+        bench_delivery(std::ranges::contains(args, "--quick") ? 1000 : 20000);
+        bench_body(std::ranges::contains(args, "--quick") ? 256 * 1024 : 5 * 1024 * 1024);
+
+        return 0;
+    }
+    catch(const std::exception &e)
+    {
+        std::print(std::cerr, "Failure: {}\n", e.what());
+        return 1;
+    }
+    catch (...)
+    {
+        std::print(std::cerr, "Unknown failure\n");
+        return 1;
+    }
+}
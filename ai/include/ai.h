@@ -1,6 +1,10 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <expected>
 #include <concepts>
+#include <cstdint>
 #include <initializer_list>
 #include <memory>
 #include <ranges>
@@ -14,11 +18,16 @@
 #include <atomic>
 #include <functional>
 #include <variant>
+#include <filesystem>
 
 #include <json.hpp>
 
-#define AI_BEG namespace ai {
-#define AI_END }
+#include "sse.h"
+#include "http.h"
+#include "deletion.h"
+#include "hedge.h"
+#include "ratelimit.h"
+#include "scheduler.h"
 
 AI_BEG
 
@@ -67,15 +76,85 @@ namespace detail
     };
 }
 
+struct cache_options;
+
+namespace detail
+{
+    class response_cache;
+}
+
 class handle : public detail::owned<handle>
 {
 public:
+    static constexpr std::string_view default_base_url = "https://api.openai.com/v1";
+
     handle(secret);
+    handle(secret, std::string key) : M_key(std::move(key)) {}
     static auto make(){ return parent::make(); }
+    static auto make(std::string key) { return parent::make(std::move(key)); }
 
     auto &key() const { return M_key; }
+
+    // Every endpoint is relative to this, "https://api.openai.com/v1" unless OPENAI_BASE_URL says otherwise.
+    // Point it at a local server (ai_mock) to run without the network. Set it before sending, not while sends run.
+    auto &base_url() const { return M_base_url; }
+    void set_base_url(std::string url);
+
+    // every request of this client borrows its easy handle from here
+    auto &pool() { return M_pool; }
+    auto pool_stats() const { return M_pool.stats(); }
+
+    // times to first byte of this client's sends, and what hedged sends did with them
+    auto &hedging() { return M_hedging; }
+    auto hedge_stats() const { return M_hedging.stats(); }
+
+    // Sends wait here until the account has room for them, as the x-ratelimit-* headers of earlier
+    // responses tell, instead of running into 429s
+    auto &rate_limits() { return M_limits; }
+    auto rate_limit_stats() const { return M_limits.stats(); }
+
+    // sends rejected with 429 or a 5xx are sent again under this policy, no retries with max_retries = 0
+    auto &retry() const { return M_retry; }
+    void set_retry_policy(retry_policy policy) { M_retry = policy; }
+
+    // Sends and background work go out in priority order through here, see thread::set_priority.
+    // Set the policy before sending, not while sends run.
+    auto &scheduler() { return M_scheduler; }
+    auto scheduler_stats() const { return M_scheduler.stats(); }
+    auto &schedule() const { return M_schedule; }
+    void set_schedule_policy(schedule_policy policy) { M_schedule = policy; }
+
+    // the one thread all transfers of this client run on
+    auto &reactor() { return M_reactor; }
+
+    // Opens a connection to the API in the background, so the next send skips DNS, TCP, TLS and HTTP/2 setup.
+    // Does nothing while a warm connection is idle in the pool or one is being opened.
+    void warm_up();
+
+    // uploaded files are deleted through here
+    auto &deletions() { return M_deletions; }
+
+    // Answers sends of cacheable assistants from complete responses stored in options.dir, a send that is
+    // not there goes to the network and is stored once it finished. An empty dir turns the cache off.
+    // Set it before sending, not while sends run.
+    std::expected<void, std::string> set_cache(cache_options options);
+    auto &cache() const { return M_cache; }
+
+    // gives queued deletes a moment to finish, whatever is left stays in the journal
+    ~handle() { M_deletions.drain(std::chrono::seconds(2)); }
 private:
     std::string M_key;
+    std::string M_base_url = std::string(default_base_url);
+    detail::connection_pool M_pool;
+    schedule_policy M_schedule;
+    detail::scheduler M_scheduler{M_reactor, M_schedule};
+    detail::deletion_queue M_deletions{M_pool, M_reactor, M_scheduler, M_key, M_base_url};
+    detail::hedge_tracker M_hedging;
+    detail::rate_limiter M_limits;
+    retry_policy M_retry;
+    std::shared_ptr<detail::response_cache> M_cache;
+    std::atomic_bool M_warming{false};
+    detail::reactor M_reactor; // last, its aborted callbacks still use the members above when destroyed
 };
 
 class assistant : public detail::shared<assistant>
@@ -90,14 +169,15 @@ public:
               const nlohmann::json &response_format = {})
               : M_client(client), M_name(name), M_instructions(instructions), M_model(model), M_response_format(response_format), M_tools(tools | std::ranges::to<std::vector<std::string>>())
     {
-        M_request["stream"] = true;
-        M_request["model"] = model;
-        M_request["instructions"] = instructions;
+        nlohmann::json request;
+        request["stream"] = true;
+        request["model"] = model;
+        request["instructions"] = instructions;
         if (!response_format.empty())
-            M_request["text"] = response_format;
-        M_request["previous_response_id"] = nullptr;
+            request["text"] = response_format;
         for (auto &tool : M_tools)
-            M_request["tools"].push_back({{"type", tool}});
+            request["tools"].push_back({{"type", tool}});
+        M_template = request.dump();
     }
 
     template <std::ranges::range R = std::ranges::empty_view<std::string>> requires(std::convertible_to<std::ranges::range_value_t<R>, std::string_view>)
@@ -117,14 +197,21 @@ public:
     auto &model() const { return M_model; }
     auto &response_format() const { return M_response_format; }
 
+    // whether the client's response cache may answer its sends, off for answers that must be fresh
+    bool cacheable() const { return M_cacheable; }
+    void set_cacheable(bool cacheable) { M_cacheable = cacheable; }
+
 private:
     handle &M_client;
     std::string M_name;
     std::string M_instructions;
     std::string M_model;
     nlohmann::json M_response_format;
-    nlohmann::json M_request;
     std::vector<std::string> M_tools;
+    // The serialized request without the per-send fields. Never changes after construction, so threads
+    // of one assistant send concurrently without sharing anything mutable.
+    std::string M_template;
+    bool M_cacheable = true;
 
     friend class thread;
 };
@@ -137,6 +224,127 @@ enum class severity_t
     fatal
 };
 
+class shared_text;
+
+// Immutable view of a shared_text at the time it was taken: the last chunk plus a length.
+// Copying one only bumps a reference count, and it stays valid and unchanged while the text keeps growing
+// or is cleared. Snapshots may be read on another thread once handed over through something that
+// synchronizes (a queued call, a mutex).
+class text_snapshot
+{
+public:
+    text_snapshot() = default;
+
+    std::size_t size() const { return M_size; }
+    bool empty() const { return M_size == 0; }
+
+    // pieces of the text in order, views stay valid as long as the snapshot
+    std::vector<std::string_view> chunks() const;
+
+    // contiguous copy of the text
+    std::string str() const;
+private:
+    struct chunk
+    {
+        std::shared_ptr<const chunk> prev;
+        std::size_t offset = 0; // of the first byte within the text
+        std::size_t capacity = 0;
+        std::unique_ptr<char[]> data;
+    };
+
+    text_snapshot(std::shared_ptr<const chunk> last, std::size_t size) : M_last(std::move(last)), M_size(size) {}
+
+    std::shared_ptr<const chunk> M_last;
+    std::size_t M_size = 0;
+
+    friend class shared_text;
+};
+
+// Append-only text kept in reference-counted chunks that never move once written.
+// Chunks grow geometrically, so an answer of n bytes is copied in once and spread over O(log n) chunks.
+// Bytes past the length of an existing snapshot are the only ones ever written.
+class shared_text
+{
+public:
+    static constexpr std::size_t min_chunk = 4096;
+
+    void append(std::string_view str);
+
+    text_snapshot snapshot() const { return {M_last, M_size}; }
+
+    std::size_t size() const { return M_size; }
+
+    // starts a new text, existing snapshots keep theirs
+    void clear()
+    {
+        M_last.reset();
+        M_size = 0;
+    }
+private:
+    std::shared_ptr<text_snapshot::chunk> M_last;
+    std::size_t M_size = 0;
+};
+
+// Where one send spent its time, every duration counted from the call to thread::send. The network parts
+// stay zero when a capture or the response cache answered, or when the send never got that far.
+struct request_metrics
+{
+    using duration = std::chrono::microseconds;
+
+    duration queued{};      // until the transfer started, waiting on the scheduler, the rate limits, the reactor and libcurl's queue
+    duration dns{};         // name lookup, zero on a reused connection
+    duration connect{};     // TCP handshake, zero on a reused connection
+    duration tls{};         // TLS handshake and HTTP/2 negotiation, zero on a reused connection
+    duration upload{};      // sending the request body
+    duration first_byte{};  // until the first byte of the response
+    duration created{};     // until response.created
+    duration first_delta{}; // until the first text delta
+    duration max_gap{};     // longest wait between two deltas
+    duration mean_gap{};
+    duration total{};       // until the response was complete, failed or was cancelled
+    std::size_t deltas = 0;
+    std::uint64_t bytes_in = 0;  // response body
+    std::uint64_t bytes_out = 0; // request body
+    bool reused = false; // connection from the pool
+    bool hedged = false; // answered by the duplicate of a hedged send
+    bool cached = false; // answered by the response cache
+
+    // How long the text streamed, from the first delta to the last. Falls back to the time after the first
+    // byte for answers of a single delta, zero without timings.
+    duration generating() const
+    {
+        auto res = deltas > 1 ? mean_gap * static_cast<duration::rep>(deltas - 1) : total - first_byte;
+        return std::max(res, duration::zero());
+    }
+};
+
+// Tokens billed for one response, from the usage of response.completed (or .incomplete).
+struct token_usage
+{
+    std::uint64_t input = 0;
+    std::uint64_t cached = 0;    // of input, served from the prompt cache
+    std::uint64_t output = 0;
+    std::uint64_t reasoning = 0; // of output, not part of the text
+
+    token_usage &operator+=(const token_usage &other)
+    {
+        input += other.input;
+        cached += other.cached;
+        output += other.output;
+        reasoning += other.reasoning;
+        return *this;
+    }
+
+    // output over the time it streamed, zero without timings
+    double output_per_second(const request_metrics &m) const
+    {
+        auto generating = m.generating();
+        if (generating == generating.zero())
+            return 0;
+        return output / std::chrono::duration<double>(generating).count();
+    }
+};
+
 namespace detail
 {
     class raw_stream
@@ -145,39 +353,90 @@ namespace detail
         using error_fun_t = std::function<void(severity_t, std::string_view)>;
 
         // delta: void(accum, delta)
+        // shared_delta: void(snapshot of accum, delta), for consumers that keep the text past the call
         // finish: void(accum)
-        raw_stream()
-        {
-            M_blocks.reserve(8);
-        }
-
         void clear()
         {
             accum.clear();
-            buffer.clear();
+            shared_accum.clear();
+            framer.clear();
             response_id.clear();
             message_id.clear();
+            item_id.clear();
+            sequence_number = -1;
             err.clear();
             err_msg.clear();
-            M_blocks.clear();
             finished = false;
+            usage = {};
+            metrics = {};
+            started = std::chrono::steady_clock::now();
+            M_stopped = false;
+            M_flushed = 0;
+            M_last_flush = {};
+            M_deferred = false;
+            M_last_delta = {};
         }
 
         std::function<void(std::string_view, std::string_view)> delta;
+        std::function<void(const text_snapshot &, std::string_view)> shared_delta;
         std::function<void(std::string_view)> finish;
         error_fun_t error;
         std::string accum;
-        std::string buffer;
+        shared_text shared_accum; // follows accum while shared_delta is set
+        sse_framer framer;
         std::string response_id;
         std::string message_id;
+        std::string item_id; // output item of the last delta
+        std::int64_t sequence_number = -1; // of the last delta
         std::string err;
         std::string err_msg;
         std::time_t created_at = 0;
-        bool finished = false;
-
-        void parse(std::string_view delta_str);
+        bool finished = false; // the text is complete, later events are still parsed
+        token_usage usage;
+        event_registry events;
+
+        // stream-side timings are filled in while parsing, the network side once the transfer completed
+        request_metrics metrics;
+        std::chrono::steady_clock::time_point started; // the send, set by clear
+
+        // coalescing: when either is set, delta fires at most once per flush_interval
+        // or once flush_bytes are pending, whichever comes first
+        std::chrono::steady_clock::duration flush_interval{};
+        std::size_t flush_bytes = 0;
+        // asked to call deferred after the wait when text is held back for flush_interval, so it shows even
+        // if no delta follows; without it held back text waits for the next delta or the end
+        std::function<void(std::chrono::steady_clock::duration wait)> defer;
+
+        // arrived: when the bytes came off the network, the timings count from it
+        void parse(std::string_view delta_str, std::chrono::steady_clock::time_point arrived = std::chrono::steady_clock::now());
+
+        // hands any coalesced text to delta
+        void flush();
+        // the wait asked for by defer is over
+        void deferred();
     private:
-        std::vector<std::string_view> M_blocks; // optimization
+        bool M_stopped = false; // nothing more to parse in this response
+        std::size_t M_flushed = 0; // bytes of accum already passed to delta
+        std::chrono::steady_clock::time_point M_last_flush;
+        bool M_deferred = false; // a defer wait is running
+        std::chrono::steady_clock::time_point M_last_delta;
+        std::chrono::steady_clock::time_point M_arrived; // of the bytes being parsed
+
+        void emit_delta();
+        // times a delta event as it arrives
+        void stamp_delta();
+
+        // built-in handling of an event, returns false once the stream should stop being parsed
+        using builtin_fun_t = bool (raw_stream::*)(std::string_view data);
+        static const std::array<builtin_fun_t, event_registry::builtin_count> M_builtins;
+
+        bool parse_block(const sse_block &block);
+
+        bool on_created(std::string_view data);
+        bool on_delta(std::string_view data);
+        bool on_text_done(std::string_view data);
+        bool on_completed(std::string_view data);
+        bool on_failed(std::string_view data);
     };
 }
 
@@ -190,22 +449,46 @@ public:
 
     auto &response_id() const { return M_stream.response_id; }
     auto &message_id() const { return M_stream.message_id; }
+    auto &item_id() const { return M_stream.item_id; }
+    auto sequence_number() const { return M_stream.sequence_number; }
     auto &err() const { return M_stream.err; }
     auto &err_msg() const { return M_stream.err_msg; }
     auto created_at() const { return M_stream.created_at; }
     auto finished() const { return M_stream.finished; }
 
+    // timings of the last send, complete once it is done
+    auto &metrics() const { return M_stream.metrics; }
+    // tokens of the last send, once it is done
+    auto &usage() const { return M_stream.usage; }
+
     void clear() { M_stream.clear(); }
 
     void set_error(error_fun_t error) { M_stream.error = std::move(error); }
+
+    // Batch deltas so the delta callback fires at most once per interval, or as soon as max_bytes are pending.
+    // Text held back by the interval is flushed when it is over, on a timer of the send's reactor, and whatever
+    // is left right before finish. Zero for both turns coalescing off (the default).
+    void set_coalescing(std::chrono::milliseconds interval, std::size_t max_bytes = 0)
+    {
+        M_stream.flush_interval = interval;
+        M_stream.flush_bytes = max_bytes;
+    }
 protected:
+    using event_fun_t = detail::event_registry::handler_t;
+
+    // called with the data of every event of this name, after any built-in handling of it
+    // (data is only valid during the call)
+    void on_event(std::string_view name, event_fun_t fun) { M_stream.events.on(name, std::move(fun)); }
+
     detail::raw_stream M_stream;
 
     friend class thread;
+    friend class capture;
 };
 
 class tool;
 class file;
+class capture;
 
 class input_content
 {
@@ -389,6 +672,9 @@ public:
         std::string input;
         std::string response;
         std::time_t created_at;
+        bool truncated = false; // cancelled, response is what arrived until then
+        request_metrics metrics;
+        token_usage usage;
     };
 
     using handle_t = std::shared_ptr<thread>;
@@ -403,9 +689,17 @@ public:
     auto &get_assistant() const { return *M_assistant; }
     auto &error() const { return M_err; }
 
-    // takes shared ownership of attached files into the sending thread
+    // err is null on success, the new message is then the last of get_messages()
+    using done_fun_t = std::move_only_function<void(std::exception_ptr err)>;
+
+    // Starts the request on the client's reactor and returns, output is called from the reactor thread.
+    // Takes shared ownership of attached files until the response is done. Threads of the same assistant
+    // may send concurrently, a thread itself sends one request at a time.
     void send(const input_t &input, stream_handler &output);
 
+    // same, done is called once the response is complete or has failed, after output is done with it
+    void send(const input_t &input, stream_handler &output, done_fun_t done);
+
     template <std::derived_from<tool> Tool>
     void send(Tool &tool, auto &&... args)
     {
@@ -414,10 +708,10 @@ public:
 
     const auto &get_messages() const { return M_messages; }
 
-    void join()
+    // waits for the response of the last send, must not be called from the reactor thread while it runs
+    void join() const
     {
-        if (M_thread.joinable())
-            M_thread.join();
+        M_running.wait(true);
     }
 
     bool is_running() const
@@ -425,15 +719,47 @@ public:
         return M_running;
     }
 
+    // Aborts the running send within milliseconds, the connection is dropped, which also stops the generation
+    // server-side. Text that already arrived is kept as a truncated message, the send completes without error.
+    // Cancelled before the response started there is no message, and the send completes with an error.
+    void cancel();
+
+    // sends that get no text within the policy's budget are sent a second time, the first to answer with text is kept
+    void set_hedging(hedge_policy policy) { M_hedge = policy; }
+
+    // The class of this thread's sends in the client's scheduler, interactive unless set otherwise.
+    // Changing it while a send runs moves that send too, as when a speculative send is taken over.
+    void set_priority(priority p);
+    priority get_priority() const { return M_priority; }
+
+    // append the raw bytes of every response to a capture file
+    void record(std::filesystem::path path) { M_record = std::move(path); }
+
+    // answer sends from a capture file instead of the network, one recorded response per send,
+    // either as fast as possible or at the recorded pacing
+    std::expected<void, std::string> replay(const std::filesystem::path &path, bool paced = false);
+
 private:
     std::vector<message> M_messages;
     assistant::handle_t M_assistant;
     std::atomic_bool M_running;
+    std::atomic_bool M_cancelled{false};
+    hedge_policy M_hedge;
+    std::atomic<priority> M_priority{priority::interactive};
+    std::atomic<detail::scheduler::id_t> M_job{0}; // of the last network send
+
+    std::filesystem::path M_record;
+    std::shared_ptr<const capture> M_replay;
+    std::size_t M_replay_next = 0;
+    bool M_replay_paced = false;
 
-    std::jthread M_thread;
     std::exception_ptr M_err;
 
     static size_t sse_write(void *contents, size_t size, size_t nmemb, void *userp);
+    static size_t header_write(char *buffer, size_t size, size_t nitems, void *userp);
+    static int progress(void *userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+    // the attempt at userp won the race of a hedged send, or has none to run, what it held back is shown
+    static void lead(void *userp, std::chrono::steady_clock::time_point now);
 };
 
 template <typename DeltaFn, typename FinishFn>
@@ -466,6 +792,11 @@ public:
 
     void set_delta(delta_fun_t delta) { M_stream.delta = std::move(delta); }
     void set_finish(finish_fun_t finish) { M_stream.finish = std::move(finish); }
+
+    // Like set_delta, but accum is a snapshot that can be kept or queued to another thread without copying
+    // the answer. Fires in addition to the delta callback.
+    using shared_delta_fun_t = std::function<void(const text_snapshot &accum, std::string_view delta)>;
+    void set_shared_delta(shared_delta_fun_t delta) { M_stream.shared_delta = std::move(delta); }
 };
 
 class json_stream_handler : public stream_handler
@@ -0,0 +1,385 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <print>
+#include <semaphore>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "ai.h"
+#include "file.h"
+
+AI_BEG
+
+namespace detail
+{
+    template <typename T>
+    struct task_result
+    {
+        std::optional<T> value;
+
+        void return_value(T v) { value.emplace(std::move(v)); }
+        T take() { return std::move(*value); }
+    };
+
+    template <>
+    struct task_result<void>
+    {
+        void return_void() {}
+        void take() {}
+    };
+
+    // eager coroutine nobody awaits, frees itself when done
+    struct detached
+    {
+        struct promise_type
+        {
+            detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+}
+
+// Lazy coroutine: starts when awaited and resumes its awaiter when done, on whatever thread it finished on
+// (the reactor thread once it awaited any I/O). Exceptions propagate to the awaiter.
+template <typename T = void>
+class task
+{
+public:
+    struct promise_type : detail::task_result<T>
+    {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr err;
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept
+        {
+            struct final_awaiter
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept { return h.promise().continuation; }
+                void await_resume() noexcept {}
+            };
+            return final_awaiter{};
+        }
+
+        void unhandled_exception() { err = std::current_exception(); }
+    };
+
+    task(task &&other) noexcept : M_handle(std::exchange(other.M_handle, nullptr)) {}
+    task &operator=(task &&other) noexcept
+    {
+        std::swap(M_handle, other.M_handle);
+        return *this;
+    }
+    ~task()
+    {
+        if (M_handle)
+            M_handle.destroy();
+    }
+
+    auto operator co_await() &&
+    {
+        struct awaiter
+        {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() { return !handle || handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume()
+            {
+                if (auto err = handle.promise().err)
+                    std::rethrow_exception(err);
+                return handle.promise().take();
+            }
+        };
+        return awaiter{M_handle};
+    }
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : M_handle(handle) {}
+
+    std::coroutine_handle<promise_type> M_handle;
+};
+
+namespace detail
+{
+    template <typename T>
+    detached run_task(task<T> t, std::optional<T> *value, std::exception_ptr *err, std::binary_semaphore *done)
+    {
+        try
+        {
+            value->emplace(co_await std::move(t));
+        }
+        catch (...)
+        {
+            *err = std::current_exception();
+        }
+        done->release();
+    }
+
+    // The value a callback API hands over, awaited by one coroutine that is resumed on the reactor loop,
+    // whether set before or after it started waiting.
+    template <typename T>
+    class pending
+    {
+    public:
+        explicit pending(reactor &reactor) : M_reactor(&reactor) {}
+
+        void set(T value)
+        {
+            std::lock_guard lock(M_mutex);
+            M_value.emplace(std::move(value));
+            if (M_waiter)
+                M_reactor->post([h = std::exchange(M_waiter, nullptr)] { h.resume(); });
+        }
+
+        auto operator co_await()
+        {
+            struct awaiter
+            {
+                pending &p;
+
+                bool await_ready()
+                {
+                    std::lock_guard lock(p.M_mutex);
+                    return p.M_value.has_value();
+                }
+                bool await_suspend(std::coroutine_handle<> h)
+                {
+                    std::lock_guard lock(p.M_mutex);
+                    if (p.M_value)
+                        return false;
+                    p.M_waiter = h;
+                    return true;
+                }
+                T await_resume()
+                {
+                    std::lock_guard lock(p.M_mutex);
+                    return std::move(*p.M_value);
+                }
+            };
+            return awaiter{*this};
+        }
+    private:
+        reactor *M_reactor;
+
+        std::mutex M_mutex;
+        std::optional<T> M_value;
+        std::coroutine_handle<> M_waiter;
+    };
+
+    inline detached run_task(task<> t, std::optional<std::monostate> *, std::exception_ptr *err, std::binary_semaphore *done)
+    {
+        try
+        {
+            co_await std::move(t);
+        }
+        catch (...)
+        {
+            *err = std::current_exception();
+        }
+        done->release();
+    }
+}
+
+// blocks the calling thread until t is done (for tests and main), never call it from the reactor thread
+template <typename T>
+T sync_wait(task<T> t)
+{
+    std::optional<std::conditional_t<std::is_void_v<T>, std::monostate, T>> value;
+    std::exception_ptr err;
+    std::binary_semaphore done(0);
+
+    detail::run_task(std::move(t), &value, &err, &done);
+    done.acquire();
+
+    if (err)
+        std::rethrow_exception(err);
+    if constexpr (!std::is_void_v<T>)
+        return std::move(*value);
+}
+
+// starts t without waiting for it, failures are printed
+inline void start(task<> t)
+{
+    [](task<> t) -> detail::detached {
+        try
+        {
+            co_await std::move(t);
+        }
+        catch (const std::exception &e)
+        {
+            std::print(std::cerr, "Task failed - {}\n", e.what());
+        }
+        catch (...)
+        {
+            std::print(std::cerr, "Task failed - Unknown error occurred.\n");
+        }
+    }(std::move(t));
+}
+
+// Stream handler for coroutines: the deltas and the final message of one send, awaited instead of called back.
+// Awaiting coroutines are resumed from the reactor loop, never from inside the parser, so they may send again
+// or do anything else without re-entering raw_stream. One awaiter of next() and one of message() at a time.
+class async_stream : public stream_handler
+{
+public:
+    using handle_t = std::shared_ptr<async_stream>;
+
+    async_stream(secret, thread &th) : M_reactor(&th.get_assistant().client().reactor()) {}
+
+    // starts sending input on th
+    static handle_t make(thread &th, const input_t &input)
+    {
+        auto res = std::make_shared<async_stream>(secret{}, th);
+        res->M_stream.delta = [res = res.get()](std::string_view, std::string_view delta) {
+            std::lock_guard lock(res->M_mutex);
+            res->M_pending.append(delta);
+            res->wake(res->M_next_waiter);
+        };
+        th.send(input, *res, [res, th = th.get_ptr()](std::exception_ptr err) {
+            std::lock_guard lock(res->M_mutex);
+            res->M_done = true;
+            res->M_err = err;
+            if (!err)
+                res->M_message = th->get_messages().back();
+            res->wake(res->M_next_waiter);
+            res->wake(res->M_message_waiter);
+        });
+        return res;
+    }
+
+    // text that arrived since the last call, nullopt once the response is over
+    auto next()
+    {
+        struct awaiter
+        {
+            async_stream &s;
+
+            bool await_ready()
+            {
+                std::lock_guard lock(s.M_mutex);
+                return !s.M_pending.empty() || s.M_done;
+            }
+            bool await_suspend(std::coroutine_handle<> h)
+            {
+                std::lock_guard lock(s.M_mutex);
+                if (!s.M_pending.empty() || s.M_done)
+                    return false;
+                s.M_next_waiter = h;
+                return true;
+            }
+            std::optional<std::string> await_resume()
+            {
+                std::lock_guard lock(s.M_mutex);
+                if (s.M_pending.empty())
+                    return std::nullopt;
+                return std::exchange(s.M_pending, {});
+            }
+        };
+        return awaiter{*this};
+    }
+
+    // the message the response added to the thread, rethrows if the send failed
+    auto message()
+    {
+        struct awaiter
+        {
+            async_stream &s;
+
+            bool await_ready()
+            {
+                std::lock_guard lock(s.M_mutex);
+                return s.M_done;
+            }
+            bool await_suspend(std::coroutine_handle<> h)
+            {
+                std::lock_guard lock(s.M_mutex);
+                if (s.M_done)
+                    return false;
+                s.M_message_waiter = h;
+                return true;
+            }
+            thread::message await_resume()
+            {
+                std::lock_guard lock(s.M_mutex);
+                if (s.M_err)
+                    std::rethrow_exception(s.M_err);
+                return *s.M_message;
+            }
+        };
+        return awaiter{*this};
+    }
+private:
+    // resumes waiter on the reactor once the caller is out of the parser
+    void wake(std::coroutine_handle<> &waiter)
+    {
+        if (waiter)
+            M_reactor->post([h = std::exchange(waiter, nullptr)] { h.resume(); });
+    }
+
+    detail::reactor *M_reactor;
+
+    std::mutex M_mutex;
+    std::string M_pending;
+    bool M_done = false;
+    std::exception_ptr M_err;
+    std::optional<thread::message> M_message;
+    std::coroutine_handle<> M_next_waiter;
+    std::coroutine_handle<> M_message_waiter;
+};
+
+// awaitable send: completes with the message the response added to th
+inline task<thread::message> send_async(thread &th, const input_t &input)
+{
+    // started here, before the returned task is awaited, so input does not have to outlive this call
+    auto s = async_stream::make(th, input);
+    return [](async_stream::handle_t s) -> task<thread::message> { co_return co_await s->message(); }(std::move(s));
+}
+
+namespace detail
+{
+    inline task<file::handle_t> await_file(std::shared_ptr<pending<std::expected<file::handle_t, std::string>>> made)
+    {
+        auto res = co_await *made;
+        if (!res)
+            throw std::runtime_error(res.error());
+        co_return std::move(res).value();
+    }
+}
+
+// Awaitable file::make: uploads without blocking any thread, so it also works on the reactor thread where
+// coroutines resume. Throws std::runtime_error if the file could not be made.
+template <std::ranges::contiguous_range R>
+task<file::handle_t> make_file_async(handle &client, const std::filesystem::path &filename, R &&bytes, file::mode m = file::mode::automatic)
+{
+    // started here, before the returned task is awaited, so bytes do not have to outlive this call
+    auto made = std::make_shared<detail::pending<std::expected<file::handle_t, std::string>>>(client.reactor());
+    file::make(client, filename, std::forward<R>(bytes), m, [made](std::expected<file::handle_t, std::string> res) { made->set(std::move(res)); });
+    return detail::await_file(std::move(made));
+}
+
+inline task<file::handle_t> make_file_async(handle &client, const std::filesystem::path &filename, file::mode m = file::mode::automatic)
+{
+    auto made = std::make_shared<detail::pending<std::expected<file::handle_t, std::string>>>(client.reactor());
+    file::make(client, filename, m, [made](std::expected<file::handle_t, std::string> res) { made->set(std::move(res)); });
+    return detail::await_file(std::move(made));
+}
+
+AI_END
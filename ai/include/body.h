@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <variant>
+
+#include <json.hpp>
+
+#include <curl/curl.h>
+
+#include "ai.h"
+
+AI_BEG
+
+namespace detail
+{
+    // Request body serialized while libcurl sends it: the assistant's template object with the per-send fields
+    // and the input (as its "input" member) spliced in. Text is escaped straight out of the input and the attached
+    // files' json, a chunk_size piece at a time, so sending a large attachment costs no copies of it beyond the buffer.
+    class body_writer
+    {
+    public:
+        static constexpr std::size_t chunk_size = 64 * 1024;
+
+        // Head is a serialized object and input the input, both must outlive the writer, fields a (small) object
+        // of per-send members. Nothing of the input is copied, attachments included.
+        body_writer(std::string_view head, const nlohmann::json &fields, const input_t &input);
+        body_writer(const body_writer &) = delete;
+        body_writer &operator=(const body_writer &) = delete;
+
+        // fills dest with up to size bytes of the body, 0 once it is complete
+        std::size_t read(char *dest, std::size_t size);
+
+        // continues at offset bytes into the body, false past its end
+        bool seek(std::size_t offset);
+
+        // the rest of the body in one string (for tests and benchmarks)
+        std::string str();
+
+        // CURLOPT_READFUNCTION with the writer as CURLOPT_READDATA
+        static std::size_t curl_read(char *buffer, std::size_t size, std::size_t nitems, void *userp);
+        // CURLOPT_SEEKFUNCTION with the writer as CURLOPT_SEEKDATA, libcurl rewinds to send the body again
+        // when a reused connection turned out to be dead
+        static int curl_seek(void *userp, curl_off_t offset, int origin);
+    private:
+        struct text
+        {
+            std::string_view rest; // not escaped yet
+            bool opened = false;
+        };
+
+        struct raw
+        {
+            std::string_view json; // serialized elsewhere, not owned
+        };
+
+        // literal json, a string escaped piece by piece, or a value expanded into pieces when reached
+        using piece = std::variant<std::string, raw, text, const nlohmann::json *>;
+
+        void start();
+        void add(const input_content &content);
+        void expand(const nlohmann::json &value);
+        bool refill();
+
+        std::string_view M_head; // without the closing brace
+        std::string M_members;
+        const input_t *M_input;
+        std::deque<piece> M_pieces;
+        std::string M_buffer;
+        std::size_t M_pos = 0;
+    };
+}
+
+AI_END
@@ -0,0 +1,90 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <json.hpp>
+
+#include "ai.h"
+#include "capture.h"
+
+AI_BEG
+
+struct cache_options
+{
+    std::filesystem::path dir;
+    std::uintmax_t max_bytes = 64 * 1024 * 1024; // least recently used responses are evicted past this
+    std::chrono::hours ttl{24 * 7}; // older responses are sent again
+    bool paced = false; // hits replay at the recorded pace instead of at once
+};
+
+namespace detail
+{
+    // FNV-1a, 64 bits: plenty to tell cached requests apart, not meant to resist crafted collisions
+    class hasher
+    {
+    public:
+        hasher &add(std::span<const std::byte> bytes);
+        // length first, so adjacent parts cannot run into each other
+        hasher &add(std::string_view text);
+        hasher &add(std::uint64_t value);
+
+        std::uint64_t value() const { return M_hash; }
+    private:
+        std::uint64_t M_hash = 0xcbf29ce484222325;
+    };
+
+    // Complete responses on disk, one capture file per request, named after the hash of everything that shapes
+    // the response: the assistant's template (model, instructions, response format, tools), the per-send fields
+    // and the input, with attachments by content hash. Thread safe.
+    class response_cache
+    {
+    public:
+        using key_t = std::uint64_t;
+
+        // base_url keeps the answers of a mock server apart from the real ones
+        static key_t key(std::string_view base_url, std::string_view head, const nlohmann::json &fields, const input_t &input);
+
+        // picks up the responses already in options.dir
+        static std::expected<std::shared_ptr<response_cache>, std::string> make(cache_options options);
+
+        explicit response_cache(cache_options options) : M_options(std::move(options)) {}
+
+        // the stored response, null on a miss or when it expired
+        std::shared_ptr<const capture> find(key_t key);
+
+        void store(key_t key, const capture::stream &s);
+
+        const auto &options() const { return M_options; }
+    private:
+        struct entry
+        {
+            std::uintmax_t size = 0;
+            std::filesystem::file_time_type stored;
+            std::uint64_t used = 0; // M_uses when it was last stored or hit
+        };
+
+        std::filesystem::path path(key_t key) const;
+
+        // with M_mutex held
+        void erase(key_t key);
+        void evict();
+
+        cache_options M_options;
+
+        std::mutex M_mutex;
+        std::unordered_map<key_t, entry> M_entries;
+        std::uintmax_t M_bytes = 0;
+        std::uint64_t M_uses = 0;
+    };
+}
+
+AI_END
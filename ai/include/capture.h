@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <expected>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ai.h"
+
+AI_BEG
+
+// Raw response bytes of thread::send as libcurl delivered them, with chunk boundaries and pacing.
+// A capture file holds one record per send:
+//   stream
+//   chunk <microseconds since the previous chunk> <size>
+//   <size raw bytes>
+//   ...
+//   end <http status>
+class capture
+{
+public:
+    enum class pacing
+    {
+        original, // sleep between chunks as they were recorded
+        fast
+    };
+
+    struct chunk
+    {
+        std::chrono::microseconds delay;
+        std::string bytes;
+    };
+
+    struct stream
+    {
+        long status = 200;
+        std::vector<chunk> chunks;
+    };
+
+    static std::expected<capture, std::string> load(const std::filesystem::path &path);
+
+    // appends one stream to the capture file at path
+    static std::expected<void, std::string> append(const std::filesystem::path &path, const stream &s);
+
+    // feeds a stream through handler as if it came from the network, returns its http status
+    static long play(const stream &s, stream_handler &handler, pacing pace = pacing::fast);
+
+    // Same on a reactor: stream index of owner is fed from the reactor thread, paced with timers instead of sleeps,
+    // and done(http status, false) is called after the last chunk. Once cancelled is set no more chunks are fed,
+    // done(http status, true) is called within milliseconds. cancelled must outlive the call of done.
+    static void play(detail::reactor &reactor, std::shared_ptr<const capture> owner, std::size_t index, std::shared_ptr<stream_handler> handler,
+                     const std::atomic_bool &cancelled, pacing pace, std::move_only_function<void(long, bool)> done);
+
+    const auto &streams() const { return M_streams; }
+private:
+    std::vector<stream> M_streams;
+};
+
+AI_END
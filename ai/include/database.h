@@ -1,7 +1,10 @@
 #pragma once
 #include "ai.h"
+#include <chrono>
 #include <expected>
 #include <filesystem>
+#include <map>
+#include <string>
 #include <vector>
 
 AI_BEG
@@ -30,14 +33,32 @@ public:
             std::filesystem::create_directories(M_path);
     }
 
+    // what a group of responses cost and how fast they streamed
+    struct usage_totals
+    {
+        std::size_t responses = 0;
+        token_usage tokens;
+        std::chrono::microseconds generating{}; // of the responses with timings
+        std::uint64_t timed_output = 0; // output tokens of those
+
+        double output_per_second() const { return generating.count() ? timed_output / std::chrono::duration<double>(generating).count() : 0; }
+        // share of input served from the prompt cache, a drop means the prompt prefix stopped being stable
+        double cached_share() const { return tokens.input ? double(tokens.cached) / tokens.input : 0; }
+    };
+
     std::expected<entry *, std::string> append(thread &th);
 
     const auto &get_entries() const { return M_entries; }
+
+    // Over every message with usage, loaded or appended. Answers of the response cache cost nothing and are skipped.
+    std::map<std::string, usage_totals> usage_by_assistant() const;
+    std::map<std::string, usage_totals> usage_by_model() const;
 private:
     std::filesystem::path M_path;
     std::vector<entry> M_entries;
 
     void load();
+    std::map<std::string, usage_totals> usage_by(std::string entry::*key) const;
 };
 
 AI_END
\ No newline at end of file
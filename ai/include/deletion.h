@@ -0,0 +1,88 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+
+#include "http.h"
+#include "scheduler.h"
+
+AI_BEG
+
+namespace detail
+{
+    // Deletes uploaded files in the background on the reactor, so dropping a file never waits on the network.
+    // Up to max_batch deletes are handed to the scheduler at once, as background requests (multiplexed over
+    // the pooled connection when their turn comes), failures are retried with exponential backoff. With a journal set, the ids of uploaded files that were not deleted yet
+    // are kept on disk, and set_journal deletes whatever an earlier session left behind.
+    class deletion_queue
+    {
+    public:
+        static constexpr std::size_t max_batch = 8;
+        static constexpr int max_attempts = 5;
+        static constexpr std::chrono::seconds retry_delay{1}; // doubles with every attempt
+
+        deletion_queue(connection_pool &pool, reactor &reactor, scheduler &scheduler, const std::string &key, const std::string &base_url)
+            : M_pool(pool), M_reactor(reactor), M_scheduler(scheduler), M_key(key), M_base_url(base_url)
+        {
+        }
+
+        // records an uploaded id in the journal until it is deleted
+        void uploaded(const std::string &id);
+
+        // queues the delete of id and returns immediately
+        void remove(std::string id);
+
+        // Uses path as the journal, ids still in it are orphans of a session that did not clean up
+        // and are queued for deletion.
+        std::expected<void, std::string> set_journal(std::filesystem::path path);
+
+        // waits until every queued delete finished or failed for good, false on timeout
+        bool drain(std::chrono::milliseconds timeout);
+
+        // deletes that have not finished yet
+        std::size_t pending() const;
+    private:
+        struct entry
+        {
+            std::string id;
+            int attempt = 0;
+        };
+
+        struct request;
+
+        // reactor thread only
+        void pump();
+        void start(entry e);
+        void send(std::shared_ptr<request> req);
+        void retry(entry e, std::string_view reason);
+        void finished(const std::string &id, bool deleted = true);
+
+        // with M_mutex held
+        void write_journal();
+
+        connection_pool &M_pool;
+        reactor &M_reactor;
+        scheduler &M_scheduler;
+        const std::string &M_key;
+        const std::string &M_base_url;
+
+        mutable std::mutex M_mutex;
+        std::condition_variable M_idle;
+        std::deque<entry> M_queue;
+        std::size_t M_in_flight = 0;
+        std::size_t M_pending = 0; // queued, in flight or waiting for a retry
+
+        std::filesystem::path M_journal;
+        std::set<std::string> M_live; // uploaded and not deleted yet
+    };
+}
+
+AI_END
@@ -1,8 +1,11 @@
 #pragma once
+#include <cstdint>
 #include <expected>
 #include <span>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <vector>
 
 #include <json.hpp>
 
@@ -13,48 +16,103 @@ AI_BEG
 class file : public detail::shared<file>
 {
 public:
-    static std::expected<handle_t, std::string> make(handle &client, const std::filesystem::path &filename)
+    enum class mode
     {
-        std::ifstream file(filename, std::ios::binary);
-        if (!file)
-            return std::unexpected(std::format("Failed to open file {}", filename.string()));
+        automatic, // images up to inline_limit bytes go inline, everything else as below
+        inline_data, // images as base64 data: urls inside the request, nothing to upload or delete
+        upload // images and pdfs through /v1/files
+    };
 
-        file.seekg(0, std::ios::end);
-        auto size = file.tellg();
-        file.seekg(0, std::ios::beg);
+    // largest image sent inline in automatic mode
+    static constexpr std::size_t inline_limit = 4 * 1024 * 1024;
 
-        std::vector<std::byte> buff(size);
-        file.read(reinterpret_cast<char *>(buff.data()), size);
+    using made_fun_t = std::move_only_function<void(std::expected<handle_t, std::string>)>;
 
-        return make(client, filename, buff);
+    // blocks while the file uploads, so on the reactor thread it fails for files that would be uploaded
+    static std::expected<handle_t, std::string> make(handle &client, const std::filesystem::path &filename, mode m = mode::automatic)
+    {
+        if (auto bytes = read(filename))
+            return make(client, filename, *bytes, m);
+        else
+            return std::unexpected(bytes.error());
     }
 
     template <std::ranges::contiguous_range R>
-    static std::expected<handle_t, std::string> make(handle &client, const std::filesystem::path &filename, R &&bytes)
+    static std::expected<handle_t, std::string> make(handle &client, const std::filesystem::path &filename, R &&bytes, mode m = mode::automatic)
     {
         if (std::ranges::empty(bytes))
             return std::unexpected(std::format("File {} is empty", filename.string()));
 
-        if (auto res = process(client, std::as_bytes(std::span(bytes)), filename))
-            return detail::shared<file>::make(client, std::move(res).value());
+        if (auto res = process(client, std::as_bytes(std::span(bytes)), filename, m))
+            return detail::shared<file>::make(client, std::move(res).value(), content_hash(std::as_bytes(std::span(bytes)), filename));
         else
             return std::unexpected(std::format("Failed to process file {} - {}\n", filename.string(), res.error()));
     }
 
+    // Never waits on the network: done runs on the reactor thread once the upload finished, or right away
+    // if there is nothing to upload. The bytes are copied, they do not have to outlive the call.
+    static void make(handle &client, const std::filesystem::path &filename, mode m, made_fun_t done)
+    {
+        if (auto bytes = read(filename))
+            make(client, filename, *bytes, m, std::move(done));
+        else
+            done(std::unexpected(bytes.error()));
+    }
+
+    template <std::ranges::contiguous_range R>
+    static void make(handle &client, const std::filesystem::path &filename, R &&bytes, mode m, made_fun_t done)
+    {
+        if (std::ranges::empty(bytes))
+            return done(std::unexpected(std::format("File {} is empty", filename.string())));
+
+        auto data = std::as_bytes(std::span(bytes));
+        process(client, data, filename, m, [&client, hash = content_hash(data, filename), name = filename.string(), done = std::move(done)](std::expected<nlohmann::json, std::string> res) mutable {
+            if (res)
+                done(detail::shared<file>::make(client, std::move(res).value(), hash));
+            else
+                done(std::unexpected(std::format("Failed to process file {} - {}\n", name, res.error())));
+        });
+    }
+
     const nlohmann::json &json() const { return request; }
+
+    // of the name and bytes, the same for the same file however it was sent
+    std::uint64_t hash() const { return M_hash; }
     
-    file(secret, handle &client, nlohmann::json &&json)
-        : request(std::move(json)), M_client(&client)
+    file(secret, handle &client, nlohmann::json &&json, std::uint64_t hash)
+        : request(std::move(json)), M_client(&client), M_hash(hash)
     {
     }
 
-    // delete file from /v1/files
+    // queues the delete from /v1/files
     ~file();
 private:
-    static std::expected<nlohmann::json, std::string> process(handle &client, std::span<const std::byte> bytes, const std::filesystem::path &filename);
+    using process_fun_t = std::move_only_function<void(std::expected<nlohmann::json, std::string>)>;
+
+    static std::expected<std::vector<std::byte>, std::string> read(const std::filesystem::path &filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+            return std::unexpected(std::format("Failed to open file {}", filename.string()));
+
+        file.seekg(0, std::ios::end);
+        auto size = file.tellg();
+        file.seekg(0, std::ios::beg);
+
+        std::vector<std::byte> buff(size);
+        file.read(reinterpret_cast<char *>(buff.data()), size);
+        return buff;
+    }
+
+    // whether process goes through /v1/files
+    static bool uploads(std::span<const std::byte> bytes, const std::filesystem::path &filename, mode m);
+    static std::expected<nlohmann::json, std::string> process(handle &client, std::span<const std::byte> bytes, const std::filesystem::path &filename, mode m);
+    static void process(handle &client, std::span<const std::byte> bytes, const std::filesystem::path &filename, mode m, process_fun_t done);
+    static std::uint64_t content_hash(std::span<const std::byte> bytes, const std::filesystem::path &filename);
 
     nlohmann::json request;
     handle *M_client;
+    std::uint64_t M_hash;
 };
 
 AI_END
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+#include "http.h"
+
+AI_BEG
+
+// Opt-in per thread: when a send has not received its first text within the budget, the same request
+// is sent again and whichever answers with text first is kept.
+struct hedge_policy
+{
+    bool enabled = false;
+    // wait before the duplicate goes out, zero for the client's rolling p90 time to first text
+    std::chrono::milliseconds budget{};
+    // used instead of the p90 while the client has too few samples for one
+    std::chrono::milliseconds fallback{2000};
+};
+
+namespace detail
+{
+    struct hedge_stats
+    {
+        std::size_t hedges = 0;       // duplicates sent
+        std::size_t wins = 0;         // duplicates that answered before their original
+        std::chrono::microseconds saved{}; // time to first text the wins saved, estimated as the originals are dropped
+        std::chrono::microseconds p90{}; // of the recent times to first text, zero until there are enough
+    };
+
+    // Times to first text of the recent sends of one client, and what hedging did with them.
+    class hedge_tracker
+    {
+    public:
+        static constexpr std::size_t window = 64;
+        static constexpr std::size_t min_samples = 8;
+
+        void sample(std::chrono::microseconds ttft);
+
+        // how long a send under policy waits before it hedges
+        std::chrono::milliseconds budget(const hedge_policy &policy) const;
+
+        // what is left of a time to first text that already took elapsed, going by the recent ones that took
+        // longer, zero if none did
+        std::chrono::microseconds remaining(std::chrono::microseconds elapsed) const;
+
+        void hedged();
+        void won();
+        void saved(std::chrono::microseconds time);
+
+        hedge_stats stats() const;
+    private:
+        // with M_mutex held
+        std::chrono::microseconds p90() const;
+
+        mutable std::mutex M_mutex;
+        std::array<std::chrono::microseconds, window> M_samples{};
+        std::size_t M_count = 0; // samples taken, the last window of them are kept
+        hedge_stats M_stats;
+    };
+}
+
+AI_END
@@ -0,0 +1,152 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <curl/curl.h>
+
+#define AI_BEG namespace ai {
+#define AI_END }
+
+AI_BEG
+
+namespace detail
+{
+    struct pool_stats
+    {
+        std::size_t hits = 0;            // requests that got an idle easy handle
+        std::size_t misses = 0;          // requests that had to create one
+        std::size_t requests = 0;        // transfers performed
+        std::size_t connections = 0;     // transfers that opened a new connection instead of reusing one
+        std::chrono::microseconds handshake{}; // total DNS, TCP and TLS setup time of those connections
+        std::chrono::microseconds last_handshake{}; // of the last transfer, zero if it reused a connection
+    };
+
+    // Easy handles and caches shared by all HTTP traffic of one handle. A curl share gives every easy handle
+    // the same connections, DNS cache and TLS sessions, so a request either reuses a connection outright or
+    // resumes the TLS session instead of a full handshake.
+    class connection_pool
+    {
+    public:
+        // easy handles kept around when idle, extra ones are cleaned up on release
+        static constexpr std::size_t max_idle = 4;
+
+        // a connection released this recently is assumed to still be open (libcurl itself drops them after 118s)
+        static constexpr std::chrono::seconds warm_for{60};
+
+        // An easy handle borrowed from the pool, reset and returned on destruction.
+        class lease
+        {
+        public:
+            lease() = default;
+            lease(const lease &) = delete;
+            lease(lease &&other) noexcept : M_pool(std::exchange(other.M_pool, nullptr)), M_curl(std::exchange(other.M_curl, nullptr)) {}
+            lease &operator=(const lease &) = delete;
+            lease &operator=(lease &&other) noexcept
+            {
+                std::swap(M_pool, other.M_pool);
+                std::swap(M_curl, other.M_curl);
+                return *this;
+            }
+            ~lease()
+            {
+                if (M_curl)
+                    M_pool->release(M_curl);
+            }
+
+            CURL *get() const { return M_curl; }
+            explicit operator bool() const { return M_curl; }
+
+            // curl_easy_perform, accounted in the pool statistics
+            CURLcode perform();
+
+            // accounts a transfer that was driven elsewhere (by a reactor) in the pool statistics
+            void account();
+        private:
+            lease(connection_pool *pool, CURL *curl) : M_pool(pool), M_curl(curl) {}
+
+            connection_pool *M_pool = nullptr;
+            CURL *M_curl = nullptr;
+
+            friend class connection_pool;
+        };
+
+        connection_pool();
+        connection_pool(const connection_pool &) = delete;
+        connection_pool &operator=(const connection_pool &) = delete;
+        ~connection_pool();
+
+        // empty lease if libcurl could not create a handle
+        lease acquire();
+
+        pool_stats stats() const;
+
+        // whether the next request most likely finds a live connection
+        bool warm() const;
+    private:
+        void release(CURL *curl);
+
+        CURLSH *M_share = nullptr;
+        std::array<std::mutex, CURL_LOCK_DATA_LAST> M_share_locks;
+
+        mutable std::mutex M_mutex;
+        std::vector<CURL *> M_idle; // the most recently released last, acquired first
+        std::chrono::steady_clock::time_point M_released; // of the last handle, its connection went to the share
+        pool_stats M_stats;
+    };
+
+    // One thread driving every transfer of a client through curl_multi, and running posted work
+    // and timers in between. Completion callbacks and posted tasks run on the reactor thread,
+    // so they must not block.
+    class reactor
+    {
+    public:
+        using task_t = std::move_only_function<void()>;
+        using done_fun_t = std::move_only_function<void(CURLcode)>;
+        using clock = std::chrono::steady_clock;
+
+        reactor();
+        reactor(const reactor &) = delete;
+        reactor &operator=(const reactor &) = delete;
+        // transfers still running are aborted, their callbacks see CURLE_ABORTED_BY_CALLBACK
+        ~reactor();
+
+        // Starts the transfer on curl (configured, not yet performed) and calls done once it finished.
+        // The easy handle must stay valid until then; done is the place to release it.
+        void add(CURL *curl, done_fun_t done);
+
+        // runs task on the reactor thread after delay
+        void post(task_t task, clock::duration delay = {});
+
+        // wakes the loop, so every transfer runs its progress callback (how cancellation is noticed)
+        void wake();
+
+        // blocks until the transfer on lease is done, fails with CURLE_RECURSIVE_API_CALL on the reactor thread
+        CURLcode perform(connection_pool::lease &lease);
+
+        bool in_loop() const { return std::this_thread::get_id() == M_thread.get_id(); }
+    private:
+        void run(std::stop_token stop);
+        void complete(CURL *curl, CURLcode result);
+
+        CURLM *M_multi = nullptr;
+
+        std::mutex M_mutex; // guards M_pending and M_timers
+        std::vector<std::pair<CURL *, done_fun_t>> M_pending;
+        std::multimap<clock::time_point, task_t> M_timers;
+
+        // only touched by the reactor thread
+        std::unordered_map<CURL *, done_fun_t> M_transfers;
+
+        std::jthread M_thread;
+    };
+}
+
+AI_END
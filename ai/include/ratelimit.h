@@ -0,0 +1,91 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string_view>
+
+#include "http.h"
+
+AI_BEG
+
+// Sends answered with 429 or a 5xx before anything streamed are sent again after a jittered, exponentially
+// growing delay, at least as long as the server's Retry-After.
+struct retry_policy
+{
+    std::size_t max_retries = 3;
+    std::chrono::milliseconds base{500}; // the first retry waits between half of this and all of it
+    std::chrono::milliseconds cap{20000};
+};
+
+namespace detail
+{
+    struct rate_limit_stats
+    {
+        std::size_t delayed = 0;  // sends held back before they would have been rejected
+        std::chrono::milliseconds delay{}; // they waited in total
+        std::size_t rejected = 0; // 429s received anyway
+        std::size_t retries = 0;
+    };
+
+    // Token buckets for the requests and tokens of one account, following the x-ratelimit-* headers of
+    // every response: a bucket holds what the server said remains, and refills to its limit by the time
+    // the server said it resets. Sends take from both before they go out, and wait when either is short.
+    class rate_limiter
+    {
+    public:
+        // one "name: value" line of a response's headers, anything but the rate limit headers is ignored
+        void observe(std::string_view header);
+
+        // a 429, nothing is admitted until retry_after has passed
+        void rejected(std::chrono::milliseconds retry_after);
+
+        // Takes one request and an estimate of its tokens, returns how long the send must wait until the
+        // account has room for it. Later sends queue behind the ones already admitted.
+        // With a reserve (a share of the limits) the send only takes from what is above it, and takes nothing
+        // until there is enough: it returns the wait, and the send asks again after it. So sends with a reserve
+        // never queue up a debt that sends without one would have to wait out.
+        std::chrono::milliseconds admit(std::uint64_t tokens, double reserve = 0);
+        // takes them only if there is room right now
+        bool try_admit(std::uint64_t tokens, double reserve = 0);
+
+        // delay before retry number attempt (from 1) under policy
+        std::chrono::milliseconds backoff(const retry_policy &policy, std::size_t attempt, std::chrono::milliseconds retry_after);
+
+        rate_limit_stats stats() const;
+
+        // "6m0s", "1.5s", "120ms" as sent in x-ratelimit-reset-*
+        static std::optional<std::chrono::milliseconds> parse_duration(std::string_view text);
+    private:
+        struct bucket
+        {
+            double limit = 0; // zero until a response reported it
+            double level = 0; // at observed, negative once sends queue for more than there is
+            double rate = 0;  // refill per second
+            std::chrono::milliseconds reset{}; // until full, as last reported
+            std::chrono::steady_clock::time_point observed;
+
+            bool known() const { return limit > 0; }
+            double now(std::chrono::steady_clock::time_point t) const;
+            // takes cost, returns the wait until the bucket had it
+            std::chrono::milliseconds take(double cost, std::chrono::steady_clock::time_point t);
+        };
+
+        // with M_mutex held
+        // how long until both buckets have the cost above the reserve
+        std::chrono::milliseconds room(std::uint64_t tokens, double reserve, std::chrono::steady_clock::time_point now) const;
+        void take(std::uint64_t tokens, double reserve, std::chrono::steady_clock::time_point now);
+        void update(bucket &b, std::optional<double> limit, std::optional<double> remaining, std::optional<std::chrono::milliseconds> reset);
+
+        mutable std::mutex M_mutex;
+        bucket M_requests;
+        bucket M_tokens;
+        std::chrono::steady_clock::time_point M_blocked_until;
+        std::minstd_rand M_random{std::random_device{}()};
+        rate_limit_stats M_stats;
+    };
+}
+
+AI_END
@@ -0,0 +1,130 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+#include "http.h"
+
+AI_BEG
+
+// What a request is for, in the order the scheduler serves them: interactive requests are the ones a user
+// waits on, prefetch requests guess at what they will wait on next, background requests nobody waits on.
+enum class priority
+{
+    interactive,
+    prefetch,
+    background
+};
+
+constexpr std::size_t priority_count = 3;
+
+struct schedule_policy
+{
+    // requests of each class in flight at once, indexed by priority, the rest wait in line
+    std::array<std::size_t, priority_count> concurrency{8, 2, 2};
+    // share of the rate limits prefetch and background requests leave to interactive ones
+    double reserve = 0.25;
+};
+
+namespace detail
+{
+    struct class_stats
+    {
+        std::size_t queued = 0;       // waiting now
+        std::size_t max_queued = 0;
+        std::size_t running = 0;      // in flight now
+        std::size_t started = 0;
+        std::size_t preempted = 0;    // times a running request was paused for an interactive one
+        std::chrono::microseconds waited{}; // in line, all started requests together
+        std::chrono::microseconds max_wait{};
+
+        std::chrono::microseconds mean_wait() const { return started ? waited / static_cast<std::chrono::microseconds::rep>(started) : std::chrono::microseconds{}; }
+    };
+
+    using scheduler_stats = std::array<class_stats, priority_count>;
+
+    // Decides when the requests of one client go out. Every class has its own concurrency limit, so a batch of
+    // background work can fill its slots but never the interactive ones, and waiting requests start in class
+    // order. While an interactive request waits for its response to start, prefetch and background requests
+    // do not start, and running ones that can be paused are paused until it started, exempt ones aside; once
+    // it streams they share the connection again. Runs on the reactor thread, every call from elsewhere (or
+    // from the scheduler's own callbacks) is queued there.
+    class scheduler
+    {
+    public:
+        using id_t = std::uint64_t;
+        // called on the reactor thread once the request may go out
+        using start_fun_t = std::move_only_function<void(id_t id)>;
+        // pauses (true) or resumes (false) the request's transfers, on the reactor thread
+        using pause_fun_t = std::move_only_function<void(bool paused)>;
+
+        scheduler(reactor &reactor, const schedule_policy &policy) : M_reactor(reactor), M_policy(policy) {}
+        scheduler(const scheduler &) = delete;
+        scheduler &operator=(const scheduler &) = delete;
+
+        // Queues a request, start is called when its turn comes. Without pause it is never preempted.
+        // The request holds its slot until finished is called with the returned id. An exempt request
+        // (one without a body worth the bandwidth, like a delete) is neither held back nor paused for
+        // interactive ones, only the concurrency of its class limits it.
+        id_t submit(priority p, start_fun_t start, pause_fun_t pause = nullptr, bool exempt = false);
+
+        // the request is done, or will never start, and frees its slot
+        void finished(id_t id);
+
+        // The response of a started request began to arrive. An interactive request holds the others back
+        // only until then, or until finished if it never calls this.
+        void settled(id_t id);
+
+        // moves a request to another class, queued or running, as a prefetch becomes what the user waits on
+        void set_priority(id_t id, priority p);
+
+        // A cancelled request: started at once if it is still waiting, resumed if it is paused, so it
+        // notices the cancellation without waiting for its turn.
+        void release(id_t id);
+
+        scheduler_stats stats() const;
+    private:
+        struct job
+        {
+            priority cls;
+            start_fun_t start; // null once started
+            pause_fun_t pause;
+            std::chrono::steady_clock::time_point submitted;
+            bool exempt = false;
+            bool paused = false;
+            bool settled = false; // its response started
+        };
+
+        // reactor thread only
+        void enqueue(id_t id, job j);
+        void remove(id_t id);
+        void change(id_t id, priority p);
+        void let_go(id_t id);
+        void settle(id_t id);
+        void run(id_t id, job &j);
+        void pump();
+        void rebalance();
+        void update_stats();
+
+        reactor &M_reactor;
+        const schedule_policy &M_policy;
+        std::atomic<id_t> M_next{0};
+
+        // reactor thread only
+        std::unordered_map<id_t, job> M_jobs; // queued and running
+        std::array<std::deque<id_t>, priority_count> M_queues;
+        std::array<std::size_t, priority_count> M_running{};
+        std::size_t M_contending = 0; // running interactive requests whose response did not start yet
+
+        mutable std::mutex M_mutex; // guards M_stats
+        scheduler_stats M_stats;
+    };
+}
+
+AI_END
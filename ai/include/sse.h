@@ -0,0 +1,280 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define AI_BEG namespace ai {
+#define AI_END }
+
+AI_BEG
+
+namespace detail
+{
+    enum class simd_t
+    {
+        scalar,
+        sse2,
+        avx2
+    };
+
+    // widest instruction set the scanner can use on this machine
+    simd_t simd_support();
+    // instruction set the scanner currently uses, defaults to simd_support()
+    simd_t simd();
+    // override the instruction set (for benchmarking), clamped to simd_support()
+    void set_simd(simd_t level);
+    std::string_view to_string(simd_t level);
+
+    // value of a field relative to the start of its block, surrounding whitespace trimmed
+    struct sse_field
+    {
+        std::size_t offset = 0;
+        std::size_t size = 0;
+    };
+
+    struct sse_block
+    {
+        std::string_view text;
+        sse_field event_field;
+        sse_field data_field;
+
+        std::string_view event() const { return text.substr(event_field.offset, event_field.size); }
+        std::string_view data() const { return text.substr(data_field.offset, data_field.size); }
+    };
+
+    // Single pass over str starting at pos: finds the next block terminator ("\n\n") while recording
+    // the last event and data fields of the lines on the way.
+    // Returns the offset of the terminator and sets block.text, or npos if the block is incomplete.
+    std::size_t scan_block(std::string_view str, std::size_t pos, sse_block &block);
+
+    // fields of a complete block (without its terminator)
+    sse_block make_block(std::string_view text);
+
+    // Splits an SSE byte stream into blocks terminated by a blank line.
+    // Blocks that arrive whole inside a chunk are handed out as views into that chunk,
+    // only an unterminated tail is copied (once), and scanning never revisits bytes already seen.
+    // Blocks are only valid for the duration of the callback.
+    class sse_framer
+    {
+    public:
+        // fn: bool(const sse_block &block), return false to stop framing
+        template <typename Fn>
+        void feed(std::string_view chunk, Fn &&fn)
+        {
+            if (chunk.empty())
+                return;
+
+            sse_block block;
+            if (!M_tail.empty())
+            {
+                std::size_t end;
+                if (M_tail.back() == '\n' && chunk.front() == '\n')
+                {
+                    // terminator straddles the two chunks
+                    M_tail.pop_back();
+                    chunk.remove_prefix(1);
+                }
+                else if (end = scan_block(chunk, 0, block); end != std::string_view::npos)
+                {
+                    M_tail.append(chunk.substr(0, end));
+                    chunk.remove_prefix(end + 2);
+                }
+                else
+                {
+                    M_tail.append(chunk);
+                    return;
+                }
+
+                // the tail was only searched for terminators, its fields are collected once here
+                bool more = fn(make_block(M_tail));
+                M_tail.clear();
+                if (!more)
+                    return;
+            }
+
+            std::size_t pos = 0;
+            for (std::size_t end; (end = scan_block(chunk, pos, block)) != std::string_view::npos; pos = end + 2)
+                if (!fn(std::as_const(block)))
+                    return;
+
+            M_tail.assign(chunk.substr(pos));
+        }
+
+        // bytes received that do not (yet) form a complete block
+        const std::string &pending() const { return M_tail; }
+
+        void clear() { M_tail.clear(); }
+    private:
+        std::string M_tail;
+    };
+
+    // Responses API events known at compile time, ids of interned custom events follow event_t::count
+    enum class event_t : std::uint8_t
+    {
+        response_created,
+        response_in_progress,
+        response_completed,
+        response_failed,
+        response_incomplete,
+        output_item_added,
+        output_item_done,
+        content_part_added,
+        content_part_done,
+        output_text_delta,
+        output_text_done,
+        output_text_annotation_added,
+        web_search_call_in_progress,
+        web_search_call_searching,
+        web_search_call_completed,
+        error,
+        count
+    };
+
+    inline constexpr std::array<std::string_view, std::size_t(event_t::count)> event_names = {
+        "response.created",
+        "response.in_progress",
+        "response.completed",
+        "response.failed",
+        "response.incomplete",
+        "response.output_item.added",
+        "response.output_item.done",
+        "response.content_part.added",
+        "response.content_part.done",
+        "response.output_text.delta",
+        "response.output_text.done",
+        "response.output_text.annotation.added",
+        "response.web_search_call.in_progress",
+        "response.web_search_call.searching",
+        "response.web_search_call.completed",
+        "error",
+    };
+
+    constexpr std::uint64_t fnv1a(std::string_view str)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325;
+        for (char c : str)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 0x100000001b3;
+        }
+        return hash;
+    }
+
+    // Perfect hash over event_names: the seed is searched at compile time so every built-in gets its own slot,
+    // a lookup is one hash, one slot load and one string compare.
+    namespace builtin_events
+    {
+        inline constexpr std::size_t bits = 6;
+        inline constexpr std::size_t size = std::size_t(1) << bits;
+
+        constexpr std::size_t slot(std::uint64_t hash, std::uint64_t seed)
+        {
+            return ((hash ^ seed) * 0x9e3779b97f4a7c15) >> (64 - bits);
+        }
+
+        inline constexpr std::uint64_t seed = [] {
+            for (std::uint64_t seed = 0; seed < 4096; ++seed)
+            {
+                std::array<bool, size> used{};
+                bool perfect = true;
+                for (auto name : event_names)
+                {
+                    auto &slot_used = used[slot(fnv1a(name), seed)];
+                    if (slot_used)
+                    {
+                        perfect = false;
+                        break;
+                    }
+                    slot_used = true;
+                }
+                if (perfect)
+                    return seed;
+            }
+            return ~std::uint64_t(0);
+        }();
+        static_assert(seed != ~std::uint64_t(0), "No perfect hash seed found for the built-in events, increase bits.");
+
+        inline constexpr std::array<event_t, size> table = [] {
+            std::array<event_t, size> table;
+            table.fill(event_t::count);
+            for (std::size_t i = 0; i < event_names.size(); ++i)
+                table[slot(fnv1a(event_names[i]), seed)] = event_t(i);
+            return table;
+        }();
+
+        // event_t::count if name is not a built-in
+        constexpr event_t find(std::string_view name)
+        {
+            auto id = table[slot(fnv1a(name), seed)];
+            if (id != event_t::count && event_names[std::size_t(id)] == name)
+                return id;
+            return event_t::count;
+        }
+    }
+
+    // Event ids and per-event handlers of one stream. Built-in names resolve through builtin_events,
+    // other names are interned the first time a handler is registered for them.
+    class event_registry
+    {
+    public:
+        static constexpr std::size_t npos = std::size_t(-1);
+        static constexpr std::size_t builtin_count = std::size_t(event_t::count);
+
+        using handler_t = std::function<void(std::string_view data)>;
+
+        // id of name, interning it if it is not a built-in
+        std::size_t intern(std::string_view name);
+
+        // id of an incoming event name, npos if it is neither a built-in nor interned
+        std::size_t find(std::string_view name) const
+        {
+            if (auto id = builtin_events::find(name); id != event_t::count)
+                return std::size_t(id);
+            if (M_custom.empty())
+                return npos;
+            if (auto it = M_custom.find(name); it != M_custom.end())
+                return it->second;
+            return npos;
+        }
+
+        // replaces the handler for name, an empty handler removes it
+        void on(std::string_view name, handler_t handler);
+
+        void dispatch(std::size_t id, std::string_view data) const
+        {
+            if (id < M_handlers.size() && M_handlers[id])
+                M_handlers[id](data);
+        }
+
+    private:
+        struct string_hash
+        {
+            using is_transparent = void;
+            std::size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+        };
+
+        std::unordered_map<std::string, std::size_t, string_hash, std::equal_to<>> M_custom;
+        std::vector<handler_t> M_handlers;
+    };
+
+    // item_id and sequence_number of a response.output_text.delta payload
+    struct delta_fields
+    {
+        std::string_view item_id; // view into the payload
+        std::int64_t sequence_number = -1;
+    };
+
+    // On-demand extraction of a response.output_text.delta payload without building a DOM:
+    // "delta" is unescaped straight onto the end of out, other members are only scanned far enough to skip them.
+    // Returns false and leaves out unchanged on anything unexpected (malformed structure, missing delta,
+    // escaped item_id), the caller should then fall back to the full parser.
+    bool extract_delta(std::string_view data, std::string &out, delta_fields &fields);
+}
+
+AI_END
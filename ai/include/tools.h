@@ -79,6 +79,7 @@ protected:
             self.tools(),
             self.make_format()
         );
+        self.M_assistant->set_cacheable(self.cacheable());
     }
 };
 
@@ -95,6 +96,7 @@ public:
     static constexpr std::string_view model() { return "gpt-4.1"; }
     static const nlohmann::json &schema() { return M_schema; }
     static constexpr auto tools() { return std::views::empty<std::string>; }
+    static constexpr bool cacheable() { return true; }
     
 private:
     static nlohmann::json M_schema;
@@ -140,6 +142,7 @@ public:
     static inline std::string_view instructions() { return M_instructions; }
     static constexpr std::string_view model() { return "gpt-4.1"; }
     static constexpr auto tools() { return std::views::single(std::string_view("web_search_preview")); }
+    static constexpr bool cacheable() { return false; } // answers from the web go stale
 
 private:
     static std::string_view M_instructions;
@@ -0,0 +1,512 @@
+// Local stand-in for the Responses and files endpoints, for load and resilience tests without the network.
+// Point a client at it with OPENAI_BASE_URL=http://127.0.0.1:<port>/v1 (or handle::set_base_url), any key works.
+//
+// ai_mock [--port 8089] [--ttft <ms>] [--tps <tokens per second>] [--fragment <bytes>]
+//         [--disconnect <probability>] [--error <probability>] [--status <http status>] [--rpm <requests per minute>]
+//         [--seed <n>] [--text <answer>]
+//
+// --fragment splits every event into writes of 1 to <bytes> bytes, so clients see SSE blocks cut anywhere.
+// --disconnect drops that share of the streams at a random token, without ending the response.
+// --error answers that share of the requests with --status (429 by default) and an API error body.
+// --rpm limits responses as an account does, with x-ratelimit-*-requests headers and 429s past the limit.
+// Without --text the answer is lorem ipsum, or an object filling the required properties of a json_schema format.
+
+#include <json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <format>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <print>
+#include <random>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+using socket_t = SOCKET;
+constexpr socket_t invalid_socket = INVALID_SOCKET;
+void close_socket(socket_t s) { closesocket(s); }
+#else
+#include <csignal>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using socket_t = int;
+constexpr socket_t invalid_socket = -1;
+void close_socket(socket_t s) { close(s); }
+#endif
+
+struct
+{
+    std::uint16_t port = 8089;
+    std::chrono::milliseconds ttft{300};
+    double tps = 50;
+    std::size_t fragment = 0; // 0 writes whole events
+    double disconnect = 0;
+    double error = 0;
+    int status = 429;
+    double rpm = 0; // 0 is unlimited
+    std::uint32_t seed = 1;
+    std::optional<std::string> text;
+} options;
+
+std::atomic<std::size_t> next_id = 0;
+
+// The requests left of --rpm, refilling evenly over a minute. Takes one, returns the x-ratelimit-* headers
+// to answer with, and the Retry-After when the request is over the limit.
+std::pair<std::string, std::optional<std::chrono::seconds>> take_request()
+{
+    static std::mutex mutex;
+    static double level = options.rpm;
+    static auto at = std::chrono::steady_clock::now();
+
+    if (options.rpm <= 0)
+        return {};
+
+    std::lock_guard lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto rate = options.rpm / 60; // per second
+    level = std::min(options.rpm, level + rate * std::chrono::duration<double>(now - at).count());
+    at = now;
+
+    std::optional<std::chrono::seconds> retry_after;
+    if (level >= 1)
+        level -= 1;
+    else
+        retry_after = std::chrono::seconds(static_cast<long long>(std::ceil((1 - level) / rate)));
+
+    auto reset = std::llround((options.rpm - level) / rate * 1000);
+    return {std::format("x-ratelimit-limit-requests: {}\r\nx-ratelimit-remaining-requests: {}\r\nx-ratelimit-reset-requests: {}ms\r\n",
+                        options.rpm, static_cast<long long>(level), reset),
+            retry_after};
+}
+
+// an abrupt close, the client sees the stream end without its terminating chunk
+struct disconnected {};
+
+class connection
+{
+public:
+    connection(socket_t s, std::uint32_t seed) : M_socket(s), M_random(seed)
+    {
+        int on = 1;
+        setsockopt(M_socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&on), sizeof(on));
+    }
+    connection(const connection &) = delete;
+    connection &operator=(const connection &) = delete;
+    ~connection() { close_socket(M_socket); }
+
+    // requests on one connection, until the client closes it or a fault drops it
+    void serve()
+    {
+        try
+        {
+            while (serve_one())
+                ;
+        }
+        catch (const disconnected &)
+        {
+        }
+    }
+private:
+    struct request
+    {
+        std::string method;
+        std::string target;
+        std::unordered_map<std::string, std::string> headers; // names in lower case
+        std::string body;
+    };
+
+    bool serve_one()
+    {
+        auto req = read_request();
+        if (!req)
+            return false;
+
+        std::print(std::cerr, "{} {} ({} bytes)\n", req->method, req->target, req->body.size());
+
+        if (req->target == "/v1/models")
+            respond(200, R"({"object":"list","data":[]})", req->method == "HEAD");
+        else if (req->method == "POST" && req->target == "/v1/files")
+            respond(200, nlohmann::json{
+                {"id", std::format("file-mock{}", ++next_id)},
+                {"object", "file"},
+                {"bytes", req->body.size()},
+                {"created_at", std::time(nullptr)},
+                {"purpose", "assistants"}
+            }.dump());
+        else if (req->method == "DELETE" && req->target.starts_with("/v1/files/"))
+            respond(200, nlohmann::json{
+                {"id", req->target.substr(std::string_view("/v1/files/").size())},
+                {"object", "file"},
+                {"deleted", true}
+            }.dump());
+        else if (req->method == "POST" && req->target == "/v1/responses")
+            stream_response(*req);
+        else
+            respond(404, R"({"error":{"code":"not_found","message":"Unknown endpoint"}})");
+
+        return true;
+    }
+
+    void stream_response(const request &req)
+    {
+        nlohmann::json body;
+        try
+        {
+            body = nlohmann::json::parse(req.body);
+        }
+        catch (const std::exception &e)
+        {
+            respond(400, nlohmann::json{{"error", {{"code", "invalid_json"}, {"message", e.what()}}}}.dump());
+            return;
+        }
+
+        auto [limits, retry_after] = take_request();
+        if (retry_after)
+        {
+            respond(429, nlohmann::json{{"error", {{"code", "rate_limit_exceeded"}, {"message", "Over --rpm"}}}}.dump(), false,
+                    std::format("{}Retry-After: {}\r\n", limits, retry_after->count()));
+            return;
+        }
+
+        if (chance(options.error))
+        {
+            auto code = options.status == 429 ? "rate_limit_exceeded" : "server_error";
+            respond(options.status, nlohmann::json{{"error", {{"code", code}, {"message", "Injected by ai_mock"}}}}.dump(), false,
+                    options.status == 429 ? "Retry-After: 1\r\n" : "");
+            return;
+        }
+
+        auto id = ++next_id;
+        auto model = body.value("model", std::string("mock"));
+        auto tokens = tokenize(answer(body));
+
+        // the token the stream drops at, if it does
+        std::optional<std::size_t> drop;
+        if (chance(options.disconnect))
+            drop = std::uniform_int_distribution<std::size_t>(0, tokens.size())(M_random);
+
+        send_all(std::format("HTTP/1.1 200 OK\r\n"
+                             "Content-Type: text/event-stream\r\n"
+                             "Cache-Control: no-cache\r\n"
+                             "Transfer-Encoding: chunked\r\n"
+                             "{}\r\n", limits));
+
+        std::this_thread::sleep_for(options.ttft);
+
+        std::size_t sequence = 0;
+        nlohmann::ordered_json response = {
+            {"id", std::format("resp_mock{}", id)},
+            {"object", "response"},
+            {"created_at", std::time(nullptr)},
+            {"status", "in_progress"},
+            {"model", model}
+        };
+        event("response.created", {{"type", "response.created"}, {"sequence_number", sequence++}, {"response", response}});
+
+        auto item_id = std::format("msg_mock{}", id);
+        auto gap = std::chrono::duration<double>(options.tps > 0 ? 1 / options.tps : 0);
+        std::string text;
+        for (std::size_t i = 0; i < tokens.size(); ++i)
+        {
+            if (drop == i)
+                throw disconnected{};
+            if (i)
+                std::this_thread::sleep_for(gap);
+
+            text += tokens[i];
+            event("response.output_text.delta", {
+                {"type", "response.output_text.delta"},
+                {"sequence_number", sequence++},
+                {"item_id", item_id},
+                {"output_index", 0},
+                {"content_index", 0},
+                {"delta", tokens[i]},
+                {"logprobs", nlohmann::ordered_json::array()}
+            });
+        }
+        if (drop == tokens.size())
+            throw disconnected{};
+
+        event("response.output_text.done", {
+            {"type", "response.output_text.done"},
+            {"sequence_number", sequence++},
+            {"item_id", item_id},
+            {"output_index", 0},
+            {"content_index", 0},
+            {"text", text}
+        });
+
+        // roughly four bytes per token, as the real tokenizer averages on English
+        auto input_tokens = req.body.size() / 4;
+        response["status"] = "completed";
+        response["usage"] = {
+            {"input_tokens", input_tokens},
+            {"input_tokens_details", {{"cached_tokens", 0}}},
+            {"output_tokens", tokens.size()},
+            {"output_tokens_details", {{"reasoning_tokens", 0}}},
+            {"total_tokens", input_tokens + tokens.size()}
+        };
+        event("response.completed", {{"type", "response.completed"}, {"sequence_number", sequence++}, {"response", response}});
+
+        write_chunk({});
+    }
+
+    static std::string answer(const nlohmann::json &body)
+    {
+        constexpr std::string_view lorem = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore "
+                                           "et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris.";
+        std::string text = options.text ? *options.text : std::string(lorem);
+
+        auto format = body.contains("text") ? body["text"].value("format", nlohmann::json::object()) : nlohmann::json::object();
+        if (format.value("type", "") != "json_schema" || !format.contains("schema"))
+            return text;
+
+        nlohmann::json res = nlohmann::json::object();
+        for (auto &name : format["schema"].value("required", nlohmann::json::array()))
+            res[name.get<std::string>()] = text;
+        return res.dump();
+    }
+
+    // words with their leading space, about the granularity of real deltas
+    static std::vector<std::string> tokenize(std::string_view text)
+    {
+        std::vector<std::string> res;
+        std::size_t start = 0;
+        for (std::size_t i = 1; i <= text.size(); ++i)
+            if (i == text.size() || text[i] == ' ')
+            {
+                res.emplace_back(text.substr(start, i - start));
+                start = i;
+            }
+        return res;
+    }
+
+    bool chance(double p)
+    {
+        return p > 0 && std::uniform_real_distribution<double>(0, 1)(M_random) < p;
+    }
+
+    // members in the order the API sends them, type first
+    void event(std::string_view name, const nlohmann::ordered_json &data)
+    {
+        auto bytes = std::format("event: {}\ndata: {}\n\n", name, data.dump());
+        std::string_view rest = bytes;
+        while (!rest.empty())
+        {
+            auto size = options.fragment ? std::uniform_int_distribution<std::size_t>(1, options.fragment)(M_random) : rest.size();
+            size = std::min(size, rest.size());
+            write_chunk(rest.substr(0, size));
+            rest.remove_prefix(size);
+        }
+    }
+
+    // one HTTP chunk per write, an empty one ends the response
+    void write_chunk(std::string_view data)
+    {
+        send_all(std::format("{:x}\r\n{}\r\n", data.size(), data));
+    }
+
+    // headers are extra "name: value\r\n" lines
+    void respond(int status, std::string_view body, bool head = false, std::string_view headers = {})
+    {
+        auto reason = status == 200 ? "OK" : status == 404 ? "Not Found" : status == 429 ? "Too Many Requests" : "Error";
+        send_all(std::format("HTTP/1.1 {} {}\r\nContent-Type: application/json\r\nContent-Length: {}\r\n{}\r\n{}",
+                             status, reason, body.size(), headers, head ? "" : body));
+    }
+
+    void send_all(std::string_view data)
+    {
+        while (!data.empty())
+        {
+            auto sent = ::send(M_socket, data.data(), static_cast<int>(data.size()), 0);
+            if (sent <= 0)
+                throw disconnected{};
+            data.remove_prefix(sent);
+        }
+    }
+
+    bool fill()
+    {
+        char buffer[16 * 1024];
+        auto got = ::recv(M_socket, buffer, sizeof(buffer), 0);
+        if (got <= 0)
+            return false;
+        M_buffer.append(buffer, got);
+        return true;
+    }
+
+    std::optional<std::string> read_line()
+    {
+        std::size_t end;
+        while ((end = M_buffer.find("\r\n")) == std::string::npos)
+            if (!fill())
+                return std::nullopt;
+
+        auto line = M_buffer.substr(0, end);
+        M_buffer.erase(0, end + 2);
+        return line;
+    }
+
+    bool read_bytes(std::size_t size, std::string &out)
+    {
+        while (M_buffer.size() < size)
+            if (!fill())
+                return false;
+
+        out.append(M_buffer, 0, size);
+        M_buffer.erase(0, size);
+        return true;
+    }
+
+    std::optional<request> read_request()
+    {
+        auto line = read_line();
+        if (!line)
+            return std::nullopt;
+
+        request req;
+        auto first = line->find(' ');
+        auto second = line->find(' ', first + 1);
+        if (first == std::string::npos || second == std::string::npos)
+            return std::nullopt;
+        req.method = line->substr(0, first);
+        req.target = line->substr(first + 1, second - first - 1);
+
+        while ((line = read_line()) && !line->empty())
+        {
+            auto colon = line->find(':');
+            if (colon == std::string::npos)
+                continue;
+            auto name = line->substr(0, colon);
+            std::ranges::transform(name, name.begin(), [](unsigned char c) { return std::tolower(c); });
+            auto value = std::string_view(*line).substr(colon + 1);
+            while (value.starts_with(' '))
+                value.remove_prefix(1);
+            req.headers[name] = value;
+        }
+        if (!line)
+            return std::nullopt;
+
+        if (auto expect = req.headers.find("expect"); expect != req.headers.end() && expect->second == "100-continue")
+            send_all("HTTP/1.1 100 Continue\r\n\r\n");
+
+        if (auto length = req.headers.find("content-length"); length != req.headers.end())
+        {
+            if (!read_bytes(std::stoull(length->second), req.body))
+                return std::nullopt;
+        }
+        else if (auto encoding = req.headers.find("transfer-encoding"); encoding != req.headers.end() && encoding->second == "chunked")
+        {
+            // the library streams its bodies without a length
+            while (true)
+            {
+                auto size_line = read_line();
+                if (!size_line)
+                    return std::nullopt;
+                auto size = std::stoull(*size_line, nullptr, 16);
+                std::string crlf;
+                if (size == 0)
+                {
+                    while ((size_line = read_line()) && !size_line->empty())
+                        ;
+                    break;
+                }
+                if (!read_bytes(size, req.body) || !read_bytes(2, crlf))
+                    return std::nullopt;
+            }
+        }
+
+        return req;
+    }
+
+    socket_t M_socket;
+    std::mt19937 M_random;
+    std::string M_buffer;
+};
+
+std::optional<std::string_view> arg_value(auto &&args, std::string_view flag)
+{
+    auto it = std::ranges::find(args, flag);
+    if (it == std::ranges::end(args) || std::ranges::next(it) == std::ranges::end(args))
+        return std::nullopt;
+    return *std::ranges::next(it);
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        auto args = std::ranges::subrange(argv + 1, argv + argc) | std::views::transform([](auto &&arg) { return std::string_view(arg); });
+        auto number = [&](std::string_view flag, auto fallback) {
+            auto value = arg_value(args, flag);
+            return value ? static_cast<decltype(fallback)>(std::stod(std::string(*value))) : fallback;
+        };
+
+        options.port = number("--port", options.port);
+        options.ttft = std::chrono::milliseconds(number("--ttft", options.ttft.count()));
+        options.tps = number("--tps", options.tps);
+        options.fragment = number("--fragment", options.fragment);
+        options.disconnect = number("--disconnect", options.disconnect);
+        options.error = number("--error", options.error);
+        options.status = number("--status", options.status);
+        options.rpm = number("--rpm", options.rpm);
+        options.seed = number("--seed", options.seed);
+        if (auto text = arg_value(args, "--text"))
+            options.text = std::string(*text);
+
+#ifdef _WIN32
+        WSADATA wsa;
+        WSAStartup(MAKEWORD(2, 2), &wsa);
+#else
+        // a client that drops a stream (a cancel, a lost hedge) fails the next send, instead of killing the server
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+        socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == invalid_socket)
+            throw std::runtime_error("Failed to create socket.");
+
+        int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&on), sizeof(on));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(options.port);
+        if (bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0)
+            throw std::runtime_error(std::format("Failed to listen on port {}.", options.port));
+
+        std::print("Listening on http://127.0.0.1:{}/v1\n", options.port);
+
+        // one thread per connection, every connection with its own reproducible faults
+        for (std::uint32_t n = 0;; ++n)
+        {
+            socket_t s = accept(listener, nullptr, nullptr);
+            if (s == invalid_socket)
+                continue;
+            std::thread([s, seed = options.seed + n] { connection(s, seed).serve(); }).detach();
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::print(std::cerr, "Failure: {}\n", e.what());
+        return 1;
+    }
+}
@@ -1,15 +1,20 @@
 #include "ai.h"
+#include "body.h"
+#include "cache.h"
+#include "capture.h"
 #include "file.h"
 
+#include <algorithm>
+#include <cctype>
 #include <cstdlib>
 
 #include <exception>
 #include <print>
 #include <iostream>
+#include <optional>
 #include <utility>
 #include <thread>
 #include <fstream>
-#include <latch>
 
 #include <curl/curl.h>
 
@@ -17,6 +22,9 @@ AI_BEG
 
 handle::handle(handle::secret)
 {    
+    if (auto var = std::getenv("OPENAI_BASE_URL"))
+        set_base_url(var);
+
     if (auto var = std::getenv("OPENAI_API_KEY"))
     {
         M_key = var;
@@ -45,144 +53,324 @@ handle::handle(handle::secret)
     throw std::runtime_error("No OpenAI API key found.");
 }
 
-std::string_view trimmed(std::string_view str)
+void handle::set_base_url(std::string url)
+{
+    while (url.ends_with('/'))
+        url.pop_back();
+    M_base_url = std::move(url);
+}
+
+void handle::warm_up()
+{
+    if (M_pool.warm() || M_warming.exchange(true))
+        return;
+
+    auto lease = std::make_shared<detail::connection_pool::lease>(M_pool.acquire());
+    if (!*lease)
+    {
+        M_warming = false;
+        return;
+    }
+
+    // Any request to the API host opens the connection, a HEAD without a key is answered right away and
+    // costs nothing. It has to negotiate HTTP/2 like send does, or send could not reuse it.
+    CURL *curl = lease->get();
+    curl_easy_setopt(curl, CURLOPT_URL, std::format("{}/models", M_base_url).c_str());
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+
+    M_reactor.add(curl, [this, lease](CURLcode) {
+        lease->account();
+        *lease = {}; // back to the pool with its connection, the next acquire gets it
+        M_warming = false;
+    });
+}
+
+std::expected<void, std::string> handle::set_cache(cache_options options)
+{
+    if (options.dir.empty())
+    {
+        M_cache.reset();
+        return {};
+    }
+
+    auto res = detail::response_cache::make(std::move(options));
+    if (!res)
+        return std::unexpected(res.error());
+    M_cache = std::move(res).value();
+    return {};
+}
+
+std::vector<std::string_view> text_snapshot::chunks() const
 {
-    constexpr std::string_view whitespace = " \t\n\r\f\v";
-    if (str.empty())
-        return str;
-    str.remove_prefix((std::min)(str.find_first_not_of(whitespace), str.size()));
-    str.remove_suffix((str.size() - 1) - str.find_last_not_of(whitespace));
-    return str;
+    std::vector<std::string_view> res;
+    std::size_t end = M_size;
+    for (auto c = M_last.get(); c && end; c = c->prev.get())
+    {
+        res.emplace_back(c->data.get(), end - c->offset);
+        end = c->offset;
+    }
+    std::ranges::reverse(res);
+    return res;
+}
+
+std::string text_snapshot::str() const
+{
+    std::string res;
+    res.reserve(M_size);
+    for (auto piece : chunks())
+        res.append(piece);
+    return res;
+}
+
+void shared_text::append(std::string_view str)
+{
+    while (!str.empty())
+    {
+        if (!M_last || M_size == M_last->offset + M_last->capacity)
+        {
+            auto next = std::make_shared<text_snapshot::chunk>();
+            next->prev = std::move(M_last);
+            next->offset = M_size;
+            next->capacity = std::max({min_chunk, M_size, str.size()});
+            next->data = std::make_unique_for_overwrite<char[]>(next->capacity);
+            M_last = std::move(next);
+        }
+
+        auto used = M_size - M_last->offset;
+        auto count = std::min(str.size(), M_last->capacity - used);
+        std::copy_n(str.data(), count, M_last->data.get() + used);
+        M_size += count;
+        str.remove_prefix(count);
+    }
 }
 
-void detail::raw_stream::parse(std::string_view delta_str)
+void detail::raw_stream::parse(std::string_view delta_str, std::chrono::steady_clock::time_point arrived)
 {
     if (delta_str.empty())
         return;
-    if (finished)
+    if (M_stopped)
         return;
-    
-    buffer.append(delta_str);
 
-    size_t pos = 0;
+    M_arrived = arrived;
+    framer.feed(delta_str, [this](const sse_block &block) { return parse_block(block); });
+}
+
+const std::array<detail::raw_stream::builtin_fun_t, detail::event_registry::builtin_count> detail::raw_stream::M_builtins = [] {
+    std::array<builtin_fun_t, event_registry::builtin_count> table{};
+    table[std::size_t(event_t::response_created)] = &raw_stream::on_created;
+    table[std::size_t(event_t::output_text_delta)] = &raw_stream::on_delta;
+    table[std::size_t(event_t::output_text_done)] = &raw_stream::on_text_done;
+    table[std::size_t(event_t::response_completed)] = &raw_stream::on_completed;
+    table[std::size_t(event_t::response_incomplete)] = &raw_stream::on_completed;
+    table[std::size_t(event_t::response_failed)] = &raw_stream::on_failed;
+    return table;
+}();
+
+bool detail::raw_stream::parse_block(const sse_block &block)
+{
+    auto id = events.find(block.event());
+    if (id == event_registry::npos)
+        return true;
+
+    auto data = block.data();
 
-    M_blocks.clear();
+    bool more = true;
+    if (id < M_builtins.size() && M_builtins[id])
+        more = (this->*M_builtins[id])(data);
+    events.dispatch(id, data);
 
-    const std::string cbuff = buffer;
+    M_stopped = !more;
+    return more;
+}
 
-    // search for blank lind for end of SSE block
-    while (true)
+void detail::raw_stream::emit_delta()
+{
+    if (flush_interval != flush_interval.zero() || flush_bytes)
     {
-        size_t end = cbuff.find("\n\n", pos);
-        if (end == std::string::npos)
-            break;
+        auto now = std::chrono::steady_clock::now();
+        bool due = (flush_interval != flush_interval.zero() && now - M_last_flush >= flush_interval) ||
+                   (flush_bytes && accum.size() - M_flushed >= flush_bytes);
+        if (!due)
+        {
+            // one wait at a time, the text held back meanwhile goes with it
+            if (defer && flush_interval != flush_interval.zero() && !std::exchange(M_deferred, true))
+                defer(flush_interval - (now - M_last_flush));
+            return;
+        }
+        M_last_flush = now;
+    }
+
+    flush();
+}
+
+void detail::raw_stream::deferred()
+{
+    if (!std::exchange(M_deferred, false))
+        return;
+    M_last_flush = std::chrono::steady_clock::now();
+    flush();
+}
+
+void detail::raw_stream::flush()
+{
+    if (M_flushed == accum.size())
+        return;
 
-        M_blocks.push_back(std::string_view(cbuff).substr(pos, end - pos));
-        pos = end + 2;
+    std::string_view ds = std::string_view(accum).substr(M_flushed);
+    M_flushed = accum.size();
+    if (delta)
+        delta(accum, ds);
+    if (shared_delta)
+    {
+        // catches up on anything accumulated before shared_delta was set
+        shared_accum.append(std::string_view(accum).substr(shared_accum.size()));
+        shared_delta(shared_accum.snapshot(), ds);
     }
+}
 
-    // remove what was parsed
-    if (pos > 0)
-        buffer.erase(0, pos);
+void detail::raw_stream::stamp_delta()
+{
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
 
-    for (auto &block : M_blocks)
+    auto now = M_arrived;
+    if (metrics.deltas++ == 0)
+        metrics.first_delta = duration_cast<microseconds>(now - started);
+    else
     {
-        std::string_view event_name;
-        std::string_view data;
+        metrics.max_gap = std::max(metrics.max_gap, duration_cast<microseconds>(now - M_last_delta));
+        metrics.mean_gap = (duration_cast<microseconds>(now - started) - metrics.first_delta) / (metrics.deltas - 1);
+    }
+    M_last_delta = now;
+}
 
-        for (size_t line_start = 0; line_start < block.size();)
+bool detail::raw_stream::on_created(std::string_view data)
+{
+    metrics.created = std::chrono::duration_cast<std::chrono::microseconds>(M_arrived - started);
+    try
+    {
+        auto j = nlohmann::json::parse(data);
+        if (j.contains("response"))
         {
-            size_t newline_pos = block.find('\n', line_start);
-            if (newline_pos == std::string::npos)
-                newline_pos = block.size();
-            
-            std::string_view line = block.substr(line_start, newline_pos - line_start);
-            if (!line.empty() && line.back() == '\r')
-                line.remove_suffix(1);
-            
-            if (line.rfind("event:", 0) == 0)
-                event_name = trimmed(line.substr(6));
-            else if (line.rfind("data:", 0) == 0)
-                data = trimmed(line.substr(5));
-            
-            line_start = newline_pos + 1;
+            response_id = j["response"]["id"];
+            created_at = j["response"]["created_at"];
         }
+    } catch (...)
+    {
+        if (error)
+            error(severity_t::warning, std::format("Failed to parse response id - {}", data));
+    }
+    return true;
+}
+
+bool detail::raw_stream::on_delta(std::string_view data)
+{
+    // the text was done, the events after it are for the handlers
+    if (finished)
+        return true;
+
+    if (delta_fields fields; extract_delta(data, accum, fields))
+    {
+        if (item_id != fields.item_id)
+            item_id = fields.item_id;
+        sequence_number = fields.sequence_number;
+
+        stamp_delta();
+        emit_delta();
+        return true;
+    }
 
-        if (event_name == "response.output_text.delta")
+    // unusual payload, go through the full parser
+    try
+    {
+        auto j = nlohmann::json::parse(data);
+        if (j.contains("delta"))
         {
-            try
-            {
-                auto j = nlohmann::json::parse(data);
-                if (j.contains("delta"))
-                {
-                    std::string ds = j["delta"];
-                    accum.append(ds);
-                    if (delta)
-                        delta(accum, ds);
-                }
-            } catch (const std::exception& e)
-            {
-                if (error)
-                    error(severity_t::warning, std::format("Failed to parse delta - {}: {}", e.what(), data));
-            }
+            accum.append(j["delta"].get_ref<const std::string &>());
+            if (j.contains("item_id") && j["item_id"].is_string())
+                item_id = j["item_id"];
+            if (j.contains("sequence_number") && j["sequence_number"].is_number_integer())
+                sequence_number = j["sequence_number"];
+            stamp_delta();
+            emit_delta();
         }
-        else if (event_name == "response.output_text.done")
-        {
-            try
-            {
-                auto j = nlohmann::json::parse(data);
-                if (j.contains("text_id"))
-                    message_id = j["item_id"];
-            }
-            catch(const std::exception& e)
-            {
-                if (error)
-                    error(severity_t::warning, std::format("Failed to parse message id - {}: {}", e.what(), data));
-            }
+    } catch (const std::exception& e)
+    {
+        if (error)
+            error(severity_t::warning, std::format("Failed to parse delta - {}: {}", e.what(), data));
+    }
+    return true;
+}
 
-            if (finish)
-                finish(accum);
-            finished = true;
-            return;
-        }
-        else if (event_name == "response.failed")
+bool detail::raw_stream::on_text_done(std::string_view data)
+{
+    try
+    {
+        auto j = nlohmann::json::parse(data);
+        if (j.contains("text_id"))
+            message_id = j["item_id"];
+    }
+    catch(const std::exception& e)
+    {
+        if (error)
+            error(severity_t::warning, std::format("Failed to parse message id - {}: {}", e.what(), data));
+    }
+
+    flush();
+    if (finish)
+        finish(accum);
+    finished = true;
+    return true; // on to the events after the text, up to response.completed
+}
+
+// the last event of a response, with its usage
+bool detail::raw_stream::on_completed(std::string_view data)
+{
+    try
+    {
+        auto j = nlohmann::json::parse(data);
+        if (j.contains("response") && j["response"].contains("usage") && j["response"]["usage"].is_object())
         {
-            try
-            {
-                auto j = nlohmann::json::parse(data);
-                if (j.contains("error"))
-                {
-                    err = j["error"]["code"];
-                    err_msg = j["error"]["message"];
-                    
-                    if (error)
-                        error(severity_t::error, std::format("Request failed with code {} - {}", err, err_msg));
-                }
-                finished = true;
-            } catch (...)
-            {
-                if (error)
-                    error(severity_t::error, std::format("Failed to parse failure message - {}", data));
-            }
-            return;
+            auto &u = j["response"]["usage"];
+            usage.input = u.value("input_tokens", std::uint64_t(0));
+            usage.output = u.value("output_tokens", std::uint64_t(0));
+            if (u.contains("input_tokens_details"))
+                usage.cached = u["input_tokens_details"].value("cached_tokens", std::uint64_t(0));
+            if (u.contains("output_tokens_details"))
+                usage.reasoning = u["output_tokens_details"].value("reasoning_tokens", std::uint64_t(0));
         }
-        else if (event_name == "response.created")
+    }
+    catch (const std::exception &e)
+    {
+        if (error)
+            error(severity_t::warning, std::format("Failed to parse usage - {}: {}", e.what(), data));
+    }
+    return false;
+}
+
+bool detail::raw_stream::on_failed(std::string_view data)
+{
+    flush();
+    try
+    {
+        auto j = nlohmann::json::parse(data);
+        if (j.contains("error"))
         {
-            try
-            {
-                auto j = nlohmann::json::parse(data);
-                if (j.contains("response"))
-                {
-                    response_id = j["response"]["id"];
-                    created_at = j["response"]["created_at"];
-                }
-            } catch (...)
-            {
-                if (error)
-                    error(severity_t::warning, std::format("Failed to parse response id - {}", data));
-            }
+            err = j["error"]["code"];
+            err_msg = j["error"]["message"];
+            
+            if (error)
+                error(severity_t::error, std::format("Request failed with code {} - {}", err, err_msg));
         }
+        finished = true;
+    } catch (...)
+    {
+        if (error)
+            error(severity_t::error, std::format("Failed to parse failure message - {}", data));
     }
+    return false;
 }
 
 nlohmann::json input_content::json() const
@@ -237,77 +425,381 @@ nlohmann::json input_t::json() const
 }
 
 
+namespace
+{
+    struct send_state;
+
+    // the event that decides the race of a hedged send, the first text of the answer
+    constexpr std::string_view first_text = "output_text.delta";
+
+    // a chunk held back while attempts race, parsed as of its arrival if its attempt wins
+    struct held_chunk
+    {
+        std::chrono::steady_clock::time_point arrived;
+        capture::chunk chunk;
+    };
+
+    // One transfer of a send. A hedged send races two of them, the first to deliver text wins.
+    struct attempt
+    {
+        send_state *state;
+        bool hedge = false;
+        detail::connection_pool::lease lease;
+        std::optional<detail::body_writer> body;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point first_byte; // unset until something arrived
+        std::chrono::steady_clock::time_point last; // of the last recorded chunk
+        std::vector<held_chunk> held; // arrived before any attempt won, shown if this one does
+        std::string tail; // the end of the last chunk, the event name may be split between it and the next
+        bool retry = false; // answered 429 or 5xx, the body is dropped and the request sent again
+        std::chrono::milliseconds retry_after{};
+    };
+
+    // everything a send needs until its response is done
+    struct send_state
+    {
+        thread *owner = nullptr;
+        stream_handler *handler = nullptr;
+        std::vector<std::shared_ptr<file>> files; // attached files stay alive (and uploaded) until then
+        std::string text_input;
+        input_t input;
+        std::uint64_t tokens = 0; // estimated, for the rate limiter
+        std::size_t retries = 0;
+        // Start a transfer of the request, right away or once the rate limits let it go. Held here for
+        // retries and dropped after end, as they hold the state.
+        std::move_only_function<void(bool hedge)> start;
+        std::move_only_function<void()> launch;
+        detail::scheduler::id_t job = 0; // set once the scheduler started the send
+        bool paused = false; // by the scheduler, for an interactive send
+        curl_slist *headers = nullptr;
+        bool record = false; // into recorded, for the capture file, the cache or both
+        capture::stream recorded;
+        std::shared_ptr<detail::response_cache> cache; // stores the response when it completes
+        detail::response_cache::key_t key = 0;
+        thread::done_fun_t done;
+
+        // reactor thread only, once the first attempt started
+        std::vector<std::unique_ptr<attempt>> attempts;
+        attempt *winner = nullptr;
+        std::size_t running = 0;
+        bool hedge_pending = false; // the hedge's budget runs, a second attempt may still start
+        bool sampled = false; // the time to the first text went to the hedge tracker
+        bool ended = false;
+
+        ~send_state()
+        {
+            attempts.clear();
+            curl_slist_free_all(headers);
+        }
+    };
+
+    // Whether attempts race for the first text and hold what they get until one wins. Without a second
+    // attempt running or about to start, the first to answer wins at its first byte.
+    bool racing(const send_state &state)
+    {
+        return state.running > 1 || (state.hedge_pending && state.retries == 0);
+    }
+
+    // the attempt that is left once no other runs or can start, if it answered and is not retried
+    attempt *survivor(const send_state &state)
+    {
+        if (state.winner || racing(state))
+            return nullptr;
+        for (auto &a : state.attempts)
+            if (a->lease && !a->retry && a->first_byte != std::chrono::steady_clock::time_point{})
+                return a.get();
+        return nullptr;
+    }
+
+    // whether the first text shows up in bytes, or across them and the end of the chunk before
+    bool finds_text(std::string &tail, std::string_view bytes)
+    {
+        auto across = tail;
+        across.append(bytes.substr(0, first_text.size() - 1));
+        bool found = across.find(first_text) != std::string::npos || bytes.find(first_text) != std::string_view::npos;
+
+        if (bytes.size() >= first_text.size() - 1)
+            tail.assign(bytes.substr(bytes.size() - (first_text.size() - 1)));
+        else
+        {
+            tail.append(bytes);
+            tail.erase(0, tail.size() - std::min(tail.size(), first_text.size() - 1));
+        }
+        return found;
+    }
+
+    // prefetch and background sends leave this share of the rate limits to interactive ones
+    double reserve(thread &t)
+    {
+        return t.get_priority() == priority::interactive ? 0 : t.get_assistant().client().schedule().reserve;
+    }
+
+    // libcurl's timings of the transfer that answered a send started at started, hedges start later
+    void network_metrics(CURL *curl, const attempt &a, std::chrono::steady_clock::time_point started, request_metrics &m)
+    {
+        using std::chrono::microseconds;
+
+        auto time = [curl](CURLINFO info) {
+            curl_off_t value = 0;
+            curl_easy_getinfo(curl, info, &value);
+            return microseconds(value);
+        };
+        // libcurl's times all count from the start of the transfer, a stage is the difference of two
+        auto stage = [](microseconds from, microseconds to) { return to > from ? to - from : microseconds{}; };
+
+        auto offset = std::chrono::duration_cast<microseconds>(a.started - started);
+#if LIBCURL_VERSION_NUM >= 0x080600
+        auto queue = time(CURLINFO_QUEUE_TIME_T);
+#else
+        microseconds queue{};
+#endif
+        auto first_byte = time(CURLINFO_STARTTRANSFER_TIME_T);
+
+        long connects = 0;
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+        m.reused = connects == 0 && first_byte > microseconds{};
+
+        m.queued = offset + queue;
+        if (!m.reused)
+        {
+            auto lookup = time(CURLINFO_NAMELOOKUP_TIME_T);
+            auto connect = time(CURLINFO_CONNECT_TIME_T);
+            m.dns = stage(queue, lookup);
+            m.connect = stage(lookup, connect);
+            m.tls = stage(connect, time(CURLINFO_APPCONNECT_TIME_T));
+        }
+#if LIBCURL_VERSION_NUM >= 0x080a00
+        m.upload = stage(time(CURLINFO_PRETRANSFER_TIME_T), time(CURLINFO_POSTTRANSFER_TIME_T));
+#endif
+        if (first_byte > microseconds{})
+            m.first_byte = offset + first_byte;
+
+        curl_off_t in = 0, out = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &in);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &out);
+        m.bytes_in = in;
+        m.bytes_out = out;
+        m.hedged = a.hedge;
+    }
+}
+
 size_t thread::sse_write(void *contents, size_t size, size_t nmemb, void *userp)
 {
     const auto total_size = size * nmemb;
-    static_cast<stream_handler *>(userp)->M_stream.parse(std::string_view(static_cast<char *>(contents), total_size));
+    auto &a = *static_cast<attempt *>(userp);
+    auto &state = *a.state;
+    std::string_view bytes(static_cast<char *>(contents), total_size);
+
+    auto now = std::chrono::steady_clock::now();
+    if (a.first_byte == std::chrono::steady_clock::time_point{})
+    {
+        a.first_byte = now;
+
+        auto &client = state.owner->M_assistant->client();
+        long status = 0;
+        curl_easy_getinfo(a.lease.get(), CURLINFO_RESPONSE_CODE, &status);
+        if ((status == 429 || status >= 500) && state.retries < client.retry().max_retries && !state.owner->M_cancelled)
+            a.retry = true;
+        // an error body has no text to race for, it is shown as it is, and an answer without a race wins at once
+        else if (!state.winner && (status != 200 || !racing(state)))
+            lead(&a, now);
+        // the response started, an interactive send no longer holds the others back
+        if (!a.retry && state.job)
+            client.scheduler().settled(state.job);
+    }
+    if (a.retry)
+        return total_size; // the error body, nothing to show
+    if (state.winner && state.winner != &a)
+        return 0; // aborts this transfer
+
+    std::chrono::microseconds delay = std::chrono::duration_cast<std::chrono::microseconds>(now - a.last);
+    a.last = now;
+
+    // the time to the first text is what hedging budgets with, whether or not this send races
+    bool text = !state.sampled && finds_text(a.tail, bytes);
+    if (text)
+    {
+        state.sampled = true;
+        state.owner->M_assistant->client().hedging().sample(std::chrono::duration_cast<std::chrono::microseconds>(now - a.started));
+    }
+
+    // Until one attempt delivers text each holds what it got, events before the text (response.created
+    // and the like) arrive on both and say nothing about which answers first.
+    if (!state.winner)
+    {
+        a.held.push_back({now, {delay, std::string(bytes)}});
+        if (text)
+            lead(&a, now);
+        return total_size;
+    }
+
+    if (state.record)
+        state.recorded.chunks.push_back({delay, std::string(bytes)});
+
+    state.handler->M_stream.parse(bytes, now);
     return total_size;
 }
 
-void thread::send(const input_t &input, stream_handler &output)
+void thread::lead(void *userp, std::chrono::steady_clock::time_point now)
 {
-    join();
+    auto &a = *static_cast<attempt *>(userp);
+    auto &state = *a.state;
+    auto &client = state.owner->M_assistant->client();
+    state.winner = &a;
 
-    std::latch started(2);
-    auto runner = [&]()
+    auto &hedging = client.hedging();
+    if (a.hedge)
+        hedging.won();
+    for (auto &other : state.attempts)
     {
-        auto handle = get_ptr();
-        auto res = output.get_ptr();
-        auto shared_files = input.files() | std::ranges::to<std::vector>();
-        auto json_input = input.json();
-
-        handle->M_running = true;
+        if (other.get() == &a || !other->lease)
+            continue;
 
-        started.arrive_and_wait();
-        
-        res->clear();
-        try
+        // The original is dropped before its text arrives. It would have come after as long again as the recent
+        // sends that took longer still needed, and no sooner than its first byte plus the time the hedge took
+        // from its own first byte to its text.
+        if (a.hedge && !other->hedge)
         {
-            auto &request = handle->M_assistant->M_request;
-            request["input"] = std::move(json_input);
-            if (!handle->M_messages.empty())
-                request["previous_response_id"] = handle->M_messages.back().id;
+            using std::chrono::microseconds;
+            auto saved = hedging.remaining(std::chrono::duration_cast<microseconds>(now - other->started));
+            if (other->first_byte != std::chrono::steady_clock::time_point{} && a.first_byte != std::chrono::steady_clock::time_point{})
+                saved = std::max(saved, std::chrono::duration_cast<microseconds>(other->first_byte + (now - a.first_byte) - now));
+            hedging.saved(saved);
+        }
+        other->held.clear();
+    }
+    // the losers are aborted by their progress callbacks, on the next pass of the loop
+    if (state.running > 1)
+        client.reactor().wake();
 
-            CURL *curl = curl_easy_init();
-            if (!curl)
-                throw std::runtime_error("Failed to initialize libcurl.\n");
+    for (auto &held : std::exchange(a.held, {}))
+    {
+        state.handler->M_stream.parse(held.chunk.bytes, held.arrived);
+        if (state.record)
+            state.recorded.chunks.push_back(std::move(held.chunk));
+    }
+}
+
+size_t thread::header_write(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    auto &a = *static_cast<attempt *>(userp);
+    std::string_view line(buffer, size * nitems);
 
-            std::string_view key = handle->M_assistant->client().key();
-            constexpr std::string_view url = "https://api.openai.com/v1/responses";
-            std::string body = request.dump();
+    a.state->owner->M_assistant->client().rate_limits().observe(line);
 
-            curl_easy_setopt(curl, CURLOPT_URL, url.data());
-            curl_easy_setopt(curl, CURLOPT_POST, 1L);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
-            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    constexpr std::string_view retry_after = "retry-after:";
+    if (line.size() > retry_after.size() && std::ranges::equal(line.substr(0, retry_after.size()), retry_after, [](unsigned char x, unsigned char y) { return std::tolower(x) == y; }))
+    {
+        auto value = line.substr(retry_after.size());
+        while (!value.empty() && std::isspace(static_cast<unsigned char>(value.front())))
+            value.remove_prefix(1);
+        while (!value.empty() && std::isspace(static_cast<unsigned char>(value.back())))
+            value.remove_suffix(1);
+        if (auto delay = detail::rate_limiter::parse_duration(value))
+            a.retry_after = *delay;
+    }
+    return size * nitems;
+}
 
-            curl_slist *headers = nullptr;
-            auto header = std::format("Authorization: Bearer {}", key);
-            headers = curl_slist_append(headers, header.data());
-            headers = curl_slist_append(headers, "Content-Type: application/json");
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+int thread::progress(void *userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    auto &a = *static_cast<attempt *>(userp);
+    auto &state = *a.state;
 
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sse_write);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, res.get());
+    // an attempt that lost is dropped at once, its connection is of no more use to the send
+    bool lost = state.winner && state.winner != &a;
 
-            curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, 128L);
-            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0L);
-            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    // nonzero aborts the transfer with CURLE_ABORTED_BY_CALLBACK
+    return state.owner->M_cancelled || lost ? 1 : 0;
+}
 
-            CURLcode cres = curl_easy_perform(curl);
-            if (cres != CURLE_OK)
-                throw std::runtime_error(std::format("Request failed: {}", curl_easy_strerror(cres)));
+void thread::cancel()
+{
+    if (!M_running)
+        return;
 
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-            curl_easy_cleanup(curl);
-            curl_slist_free_all(headers);
+    M_cancelled = true;
+    // a send still waiting for its turn starts to notice, a paused one resumes
+    if (auto job = M_job.load())
+        M_assistant->client().scheduler().release(job);
+    // the progress callback runs on the next pass of the loop, instead of whenever data or curl's timeout comes
+    M_assistant->client().reactor().wake();
+}
+
+void thread::set_priority(priority p)
+{
+    M_priority = p;
+    if (auto job = M_job.load(); job && M_running)
+        M_assistant->client().scheduler().set_priority(job, p);
+}
+
+std::expected<void, std::string> thread::replay(const std::filesystem::path &path, bool paced)
+{
+    auto loaded = capture::load(path);
+    if (!loaded)
+        return std::unexpected(loaded.error());
+
+    join();
+    M_replay = std::make_shared<const capture>(*std::move(loaded));
+    M_replay_next = 0;
+    M_replay_paced = paced;
+    return {};
+}
+
+void thread::send(const input_t &input, stream_handler &output)
+{
+    send(input, output, nullptr);
+}
+
+void thread::send(const input_t &input, stream_handler &output, done_fun_t done)
+{
+    join();
+
+    auto handle = get_ptr();
+    auto res = output.get_ptr();
+    auto state = std::make_shared<send_state>();
+    // the caller's input is gone by the time a delayed, hedged or retried transfer starts, every attempt's body reads this copy
+    state->input = input;
+    state->files = input.files() | std::ranges::to<std::vector>();
+    state->done = std::move(done);
+
+    M_running = true;
+    M_cancelled = false;
+    res->clear();
+    // coalesced text held back shows when its interval is over, on the reactor that parses the response
+    res->M_stream.defer = [&reactor = M_assistant->client().reactor(), weak = std::weak_ptr(res)](std::chrono::steady_clock::duration wait) {
+        reactor.post([weak] {
+            if (auto res = weak.lock())
+                res->M_stream.deferred();
+        }, wait);
+    };
+
+    // runs exactly once, on the reactor thread unless the send failed before reaching it
+    auto end = [handle, res, state](long response_code, std::exception_ptr err) {
+        state->ended = true;
+        auto &client = handle->M_assistant->client();
+        if (state->job)
+            client.scheduler().finished(state->job);
+        // not here, end may run inside them
+        client.reactor().post([state] {
+            state->start = nullptr;
+            state->launch = nullptr;
+        });
+        res->M_stream.flush();
+        res->M_stream.metrics.total = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - res->M_stream.started);
+        std::exception_ptr failure;
+        try
+        {
+            // the transfer was aborted by cancel, what arrived until then is kept
+            bool truncated = err && handle->M_cancelled;
+            if (err && !truncated)
+                std::rethrow_exception(err);
 
-            if (response_code != 200)
+            if (response_code != 200 && !truncated)
             {
                 try
                 {
-                    auto j = nlohmann::json::parse(res->M_stream.buffer);
+                    auto j = nlohmann::json::parse(res->M_stream.framer.pending());
                     res->M_stream.err = j["error"]["code"];
                     res->M_stream.err_msg = j["error"]["message"];
                 }
@@ -320,22 +812,6 @@ void thread::send(const input_t &input, stream_handler &output)
                 else
                     throw std::runtime_error(std::format("Request failed with code {}: {}", res->M_stream.err, res->M_stream.err_msg));
             }
-            
-            auto text_input = [&request]() {
-                auto &input = request["input"];
-                if (input.is_string())
-                    return input.get<std::string>();
-
-                for (const auto &item : input)
-                    if (item.contains("content"))
-                        return item["content"] | std::views::filter([](auto &&content) { return content.contains("text"); }) |
-                                                 std::views::transform([](auto &&content) { return std::format("\n{}", content["text"].template get<std::string>()); }) |
-                                                 std::views::join | 
-                                                 std::views::drop(1) | 
-                                                 std::ranges::to<std::string>();
-
-                return std::string{};
-            }();
 
             auto response = [&res]() {
                 using namespace std::string_view_literals;
@@ -345,7 +821,11 @@ void thread::send(const input_t &input, stream_handler &output)
                 return accum;
             }();
 
-            handle->M_messages.push_back({.id = res->M_stream.response_id, .input = text_input, .response = response, .created_at = res->M_stream.created_at});
+            // cancelled before the response started, there is nothing to keep or continue from
+            if (truncated && res->M_stream.response_id.empty())
+                handle->M_err = failure = std::make_exception_ptr(std::runtime_error("Request cancelled before the response started."));
+            else
+                handle->M_messages.push_back({.id = res->M_stream.response_id, .input = state->text_input, .response = response, .created_at = res->M_stream.created_at, .truncated = truncated, .metrics = res->M_stream.metrics, .usage = res->M_stream.usage});
         }
         catch (const std::exception &e)
         {
@@ -353,7 +833,7 @@ void thread::send(const input_t &input, stream_handler &output)
                 res->M_stream.error(severity_t::fatal, std::format("Error sending request - {}", e.what()));
             else
                 std::print(std::cerr, "Error sending request - {}\n", e.what());
-            handle->M_err = std::current_exception();
+            handle->M_err = failure = std::current_exception();
         }
         catch (...)
         {
@@ -361,14 +841,301 @@ void thread::send(const input_t &input, stream_handler &output)
                 res->M_stream.error(severity_t::fatal, std::format("Error sending request - Unknown error occurred."));
             else
                 std::print(std::cerr, "Error sending request - Unknown error occurred.\n");
-            handle->M_err = std::current_exception();
+            handle->M_err = failure = std::current_exception();
         }
 
         handle->M_running = false;
+        handle->M_running.notify_all();
+
+        if (state->done)
+            state->done(failure);
     };
 
-    M_thread = std::jthread(runner);
-    started.arrive_and_wait();
+    try
+    {
+        // the only per-send part of the request, the assistant's template is shared read-only
+        nlohmann::json fields = {{"previous_response_id", nullptr}};
+        if (!M_messages.empty())
+            fields["previous_response_id"] = M_messages.back().id;
+
+        state->text_input = [&input]() {
+            if (std::holds_alternative<std::string>(input.value))
+                return std::get<std::string>(input.value);
+
+            auto &messages = std::get<input_t::array_t>(input.value);
+            if (messages.empty())
+                return std::string{};
+
+            auto &content = messages.front().second;
+            if (std::holds_alternative<std::string>(content.value))
+                return std::get<std::string>(content.value);
+
+            // the texts of the first message, attached text files included
+            std::string text;
+            bool first = true;
+            for (auto &item : std::get<input_content::array_t>(content.value))
+            {
+                const std::string *part = nullptr;
+                if (std::holds_alternative<std::string>(item))
+                    part = &std::get<std::string>(item);
+                else if (auto &j = std::get<std::shared_ptr<file>>(item)->json(); j.contains("text"))
+                    part = &j["text"].get_ref<const std::string &>();
+                else
+                    continue;
+
+                if (!std::exchange(first, false))
+                    text += '\n';
+                text += *part;
+            }
+            return text;
+        }();
+
+        // a cancelled replay ends like a cancelled transfer, truncated
+        auto replayed = [end](long response_code, bool cancelled) {
+            end(response_code, cancelled ? std::make_exception_ptr(std::runtime_error("Request cancelled.")) : nullptr);
+        };
+
+        auto &client = M_assistant->client();
+        if (M_replay)
+        {
+            auto &streams = M_replay->streams();
+            if (M_replay_next >= streams.size())
+                throw std::runtime_error("Capture has no more recorded responses.");
+
+            auto pace = M_replay_paced ? capture::pacing::original : capture::pacing::fast;
+            capture::play(client.reactor(), M_replay, M_replay_next++, res, M_cancelled, pace, replayed);
+            return;
+        }
+
+        if (auto &cache = client.cache(); cache && M_assistant->cacheable())
+        {
+            state->key = detail::response_cache::key(client.base_url(), M_assistant->M_template, fields, input);
+            if (auto hit = cache->find(state->key))
+            {
+                res->M_stream.metrics.cached = true;
+                auto pace = cache->options().paced ? capture::pacing::original : capture::pacing::fast;
+                capture::play(client.reactor(), std::move(hit), 0, res, M_cancelled, pace, replayed);
+                return;
+            }
+            state->cache = cache;
+        }
+
+        auto header = std::format("Authorization: Bearer {}", client.key());
+        state->headers = curl_slist_append(state->headers, header.data());
+        state->headers = curl_slist_append(state->headers, "Content-Type: application/json");
+        state->headers = curl_slist_append(state->headers, "Expect:"); // no 100-continue round trip before the body
+
+        state->owner = this;
+        state->handler = res.get();
+        state->record = !M_record.empty() || state->cache;
+
+        // starts one transfer of the request, a second one when it is hedged, more when they are retried
+        state->start = [handle, res, state, end, fields](bool hedge) {
+            auto &client = handle->M_assistant->client();
+            auto &a = *state->attempts.emplace_back(std::make_unique<attempt>(state.get(), hedge, client.pool().acquire()));
+            if (!a.lease)
+                throw std::runtime_error("Failed to initialize libcurl.\n");
+            CURL *curl = a.lease.get();
+            a.started = a.last = std::chrono::steady_clock::now();
+
+
+            // Serialized while it is sent, attachments are never copied into one big body. Without a size
+            // libcurl sends it chunked over HTTP/1.1 and as plain DATA frames over HTTP/2.
+            a.body.emplace(handle->M_assistant->M_template, fields, state->input);
+
+            curl_easy_setopt(curl, CURLOPT_URL, std::format("{}/responses", client.base_url()).c_str());
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_READFUNCTION, detail::body_writer::curl_read);
+            curl_easy_setopt(curl, CURLOPT_READDATA, &*a.body);
+            curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, detail::body_writer::curl_seek);
+            curl_easy_setopt(curl, CURLOPT_SEEKDATA, &*a.body);
+            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, state->headers);
+
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sse_write);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &a);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_write);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &a);
+
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress);
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &a);
+
+            curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, 128L);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0L);
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+
+            ++state->running;
+            if (state->paused)
+                curl_easy_pause(curl, CURLPAUSE_ALL);
+
+            client.reactor().add(curl, [handle, res, state, a = &a, end](CURLcode cres) {
+                a->lease.account();
+                --state->running;
+
+                long response_code = 0;
+                curl_easy_getinfo(a->lease.get(), CURLINFO_RESPONSE_CODE, &response_code);
+                request_metrics timings;
+                network_metrics(a->lease.get(), *a, res->M_stream.started, timings);
+                a->lease = {};
+
+                auto &limits = handle->M_assistant->client().rate_limits();
+                if (response_code == 429)
+                    limits.rejected(a->retry_after);
+
+                // rejected or failed on the server's side, sent again after a backoff unless another attempt answers
+                if (a->retry && !handle->M_cancelled)
+                {
+                    if (state->winner || state->running > 0 || state->ended)
+                    {
+                        if (auto other = survivor(*state))
+                            lead(other, std::chrono::steady_clock::now());
+                        return;
+                    }
+
+                    // the rate limits are asked again when it is launched
+                    auto delay = limits.backoff(handle->M_assistant->client().retry(), ++state->retries, a->retry_after);
+                    handle->M_assistant->client().reactor().post([state] {
+                        if (state->launch)
+                            state->launch();
+                    }, delay);
+                    return;
+                }
+
+                if (state->winner && state->winner != a)
+                    return;
+
+                if (!state->winner)
+                {
+                    // failed before delivering text, the other attempt may still answer
+                    if (cres != CURLE_OK && state->running > 0)
+                    {
+                        if (auto other = survivor(*state))
+                            lead(other, std::chrono::steady_clock::now());
+                        return;
+                    }
+                    // complete without text (only tool calls, say), or the last one left
+                    lead(a, std::chrono::steady_clock::now());
+                }
+
+                auto &metrics = res->M_stream.metrics;
+                metrics.queued = timings.queued;
+                metrics.dns = timings.dns;
+                metrics.connect = timings.connect;
+                metrics.tls = timings.tls;
+                metrics.upload = timings.upload;
+                metrics.first_byte = timings.first_byte;
+                metrics.bytes_in = timings.bytes_in;
+                metrics.bytes_out = timings.bytes_out;
+                metrics.reused = timings.reused;
+                metrics.hedged = timings.hedged;
+
+                state->recorded.status = response_code;
+                if (!handle->M_record.empty())
+                {
+                    if (auto r = capture::append(handle->M_record, state->recorded); !r && res->M_stream.error)
+                        res->M_stream.error(severity_t::warning, r.error());
+                }
+
+                // only complete answers, a failed or cancelled send is sent again next time
+                if (state->cache && cres == CURLE_OK && response_code == 200 && !handle->M_cancelled && res->M_stream.err.empty())
+                    state->cache->store(state->key, state->recorded);
+
+                if (cres != CURLE_OK)
+                    end(response_code, std::make_exception_ptr(std::runtime_error(std::format("Request failed: {}", curl_easy_strerror(cres)))));
+                else
+                    end(response_code, nullptr);
+            });
+        };
+
+        // about four characters a token, attachments are not counted
+        state->tokens = (M_assistant->M_template.size() + state->text_input.size()) / 4 + 1;
+
+        // starts the first transfer, or the next after a retryable failure, and hedges the first
+        auto begin = [handle, state, end]() {
+            if (state->ended)
+                return;
+            if (handle->M_cancelled)
+                return end(0, std::make_exception_ptr(std::runtime_error("Request cancelled.")));
+
+            try
+            {
+                state->start(false);
+            }
+            catch (...)
+            {
+                return end(0, std::current_exception());
+            }
+
+            if (!handle->M_hedge.enabled || state->retries > 0)
+                return;
+
+            // until the budget runs out the first attempt holds what it gets, a hedge may still win
+            state->hedge_pending = true;
+            auto &client = handle->M_assistant->client();
+            client.reactor().post([handle, state]() {
+                state->hedge_pending = false;
+
+                // a retried or paused send is not hedged, and a hedge never waits for the rate limits
+                auto &client = handle->M_assistant->client();
+                bool hedge = !state->winner && !state->ended && state->retries == 0 && !state->paused && !handle->M_cancelled && state->start &&
+                             client.rate_limits().try_admit(state->tokens, reserve(*handle));
+                if (hedge)
+                {
+                    try
+                    {
+                        state->start(true);
+                        client.hedging().hedged();
+                        return;
+                    }
+                    catch (const std::exception &e)
+                    {
+                        std::print(std::cerr, "Failed to hedge request - {}\n", e.what());
+                    }
+                }
+
+                // no race after all, the first attempt shows what it held
+                if (auto a = survivor(*state))
+                    lead(a, std::chrono::steady_clock::now());
+            }, client.hedging().budget(handle->M_hedge));
+        };
+
+        // begins once the rate limits let the send go
+        state->launch = [handle, state, begin]() {
+            if (state->ended)
+                return;
+
+            // Without a reserve the send took its share and only waits it out, with one it took nothing and
+            // asks again. A send cancelled meanwhile ends at once.
+            auto &client = handle->M_assistant->client();
+            auto share = reserve(*handle);
+            auto wait = handle->M_cancelled ? std::chrono::milliseconds{} : client.rate_limits().admit(state->tokens, share);
+            if (wait.count() == 0)
+                begin();
+            else if (share > 0)
+                client.reactor().post([state] {
+                    if (state->launch)
+                        state->launch();
+                }, wait);
+            else
+                client.reactor().post(begin, wait);
+        };
+
+        // in the client's scheduler, the transfers of a paused send are paused with it
+        M_job = client.scheduler().submit(M_priority, [state](detail::scheduler::id_t job) {
+            state->job = job;
+            state->launch();
+        }, [state](bool paused) {
+            state->paused = paused;
+            for (auto &a : state->attempts)
+                if (a->lease)
+                    curl_easy_pause(a->lease.get(), paused ? CURLPAUSE_ALL : CURLPAUSE_CONT);
+        });
+    }
+    catch (...)
+    {
+        end(0, std::current_exception());
+    }
 }
 
 void json_stream_handler::parse(std::string_view accum)
@@ -0,0 +1,264 @@
+#include "body.h"
+#include "file.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+AI_BEG
+
+namespace detail
+{
+    namespace
+    {
+        const char *role_str(input_t::role r)
+        {
+            switch (r)
+            {
+            case input_t::role::user: return "user";
+            case input_t::role::assistant: return "assistant";
+            case input_t::role::developer: return "developer";
+            default: return "";
+            }
+        }
+
+        // json string escaping as nlohmann::json::dump does it, without the quotes
+        void escape(std::string &out, std::string_view in)
+        {
+            static constexpr char hex[] = "0123456789abcdef";
+            auto plain = in.begin();
+            for (auto it = in.begin(); it != in.end(); ++it)
+            {
+                auto c = static_cast<unsigned char>(*it);
+                if (c >= 0x20 && c != '"' && c != '\\')
+                    continue;
+
+                out.append(plain, it);
+                plain = it + 1;
+                switch (c)
+                {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+                }
+            }
+            out.append(plain, in.end());
+        }
+    }
+
+    body_writer::body_writer(std::string_view head, const nlohmann::json &fields, const input_t &input) : M_head(head), M_input(&input)
+    {
+        M_head.remove_suffix(1); // closing brace
+
+        for (auto &[key, value] : fields.items())
+            M_members += std::format(",{}:{}", nlohmann::json(key).dump(), value.dump());
+        M_members += ",\"input\":";
+        if (M_head.size() == 1) // empty template
+            M_members.erase(0, 1);
+
+        start();
+    }
+
+    void body_writer::start()
+    {
+        // pieces point into the head, the members and the input, none of which change
+        M_pieces.clear();
+        M_buffer.clear();
+        M_pos = 0;
+
+        M_pieces.emplace_back(raw{M_head});
+        M_pieces.emplace_back(raw{M_members});
+
+        if (std::holds_alternative<std::string>(M_input->value))
+            M_pieces.emplace_back(text{std::get<std::string>(M_input->value)});
+        else
+        {
+            M_pieces.emplace_back("[");
+            bool first = true;
+            for (auto &[role, content] : std::get<input_t::array_t>(M_input->value))
+            {
+                M_pieces.emplace_back(std::format("{}{{\"role\":\"{}\",\"content\":", first ? "" : ",", role_str(role)));
+                add(content);
+                M_pieces.emplace_back("}");
+                first = false;
+            }
+            M_pieces.emplace_back("]");
+        }
+        M_pieces.emplace_back("}");
+    }
+
+    void body_writer::add(const input_content &content)
+    {
+        if (std::holds_alternative<std::string>(content.value))
+        {
+            M_pieces.emplace_back(text{std::get<std::string>(content.value)});
+            return;
+        }
+
+        M_pieces.emplace_back("[");
+        bool first = true;
+        for (auto &item : std::get<input_content::array_t>(content.value))
+        {
+            if (!first)
+                M_pieces.emplace_back(",");
+            first = false;
+
+            if (std::holds_alternative<std::string>(item))
+            {
+                M_pieces.emplace_back("{\"type\":\"input_text\",\"text\":");
+                M_pieces.emplace_back(text{std::get<std::string>(item)});
+                M_pieces.emplace_back("}");
+            }
+            else
+                M_pieces.emplace_back(&std::get<std::shared_ptr<file>>(item)->json());
+        }
+        M_pieces.emplace_back("]");
+    }
+
+    void body_writer::expand(const nlohmann::json &value)
+    {
+        // replaces the front piece, the members are small and the strings in them are not copied
+        std::vector<piece> pieces;
+        if (value.is_object())
+        {
+            pieces.emplace_back("{");
+            bool first = true;
+            for (auto &[key, member] : value.items())
+            {
+                pieces.emplace_back(std::format("{}{}:", first ? "" : ",", nlohmann::json(key).dump()));
+                pieces.emplace_back(&member);
+                first = false;
+            }
+            pieces.emplace_back("}");
+        }
+        else if (value.is_array())
+        {
+            pieces.emplace_back("[");
+            bool first = true;
+            for (auto &element : value)
+            {
+                if (!first)
+                    pieces.emplace_back(",");
+                pieces.emplace_back(&element);
+                first = false;
+            }
+            pieces.emplace_back("]");
+        }
+        else if (value.is_string())
+            pieces.emplace_back(text{value.get_ref<const std::string &>()});
+        else
+            pieces.emplace_back(value.dump());
+
+        M_pieces.pop_front();
+        M_pieces.insert(M_pieces.begin(), std::make_move_iterator(pieces.begin()), std::make_move_iterator(pieces.end()));
+    }
+
+    bool body_writer::refill()
+    {
+        M_buffer.clear();
+        M_pos = 0;
+
+        while (M_buffer.size() < chunk_size && !M_pieces.empty())
+        {
+            auto &front = M_pieces.front();
+            if (auto literal = std::get_if<std::string>(&front))
+            {
+                M_buffer += *literal;
+                M_pieces.pop_front();
+            }
+            else if (auto r = std::get_if<raw>(&front))
+            {
+                M_buffer += r->json;
+                M_pieces.pop_front();
+            }
+            else if (auto t = std::get_if<text>(&front))
+            {
+                if (!std::exchange(t->opened, true))
+                    M_buffer += '"';
+
+                // escapes may push the buffer past chunk_size, it is only a target
+                auto n = std::min(t->rest.size(), chunk_size - M_buffer.size());
+                escape(M_buffer, t->rest.substr(0, n));
+                t->rest.remove_prefix(n);
+
+                if (t->rest.empty())
+                {
+                    M_buffer += '"';
+                    M_pieces.pop_front();
+                }
+            }
+            else
+                expand(*std::get<const nlohmann::json *>(front));
+        }
+
+        return !M_buffer.empty();
+    }
+
+    std::size_t body_writer::read(char *dest, std::size_t size)
+    {
+        std::size_t written = 0;
+        while (written < size)
+        {
+            if (M_pos == M_buffer.size() && !refill())
+                break;
+
+            auto n = std::min(size - written, M_buffer.size() - M_pos);
+            std::memcpy(dest + written, M_buffer.data() + M_pos, n);
+            M_pos += n;
+            written += n;
+        }
+        return written;
+    }
+
+    bool body_writer::seek(std::size_t offset)
+    {
+        // the body is generated, not stored: serialized again from the start up to offset
+        start();
+        while (offset > 0)
+        {
+            if (M_pos == M_buffer.size() && !refill())
+                return false;
+
+            auto n = std::min(offset, M_buffer.size() - M_pos);
+            M_pos += n;
+            offset -= n;
+        }
+        return true;
+    }
+
+    std::string body_writer::str()
+    {
+        std::string res(M_buffer, M_pos);
+        while (refill())
+            res += M_buffer;
+        M_pos = M_buffer.size();
+        return res;
+    }
+
+    std::size_t body_writer::curl_read(char *buffer, std::size_t size, std::size_t nitems, void *userp)
+    {
+        return static_cast<body_writer *>(userp)->read(buffer, size * nitems);
+    }
+
+    int body_writer::curl_seek(void *userp, curl_off_t offset, int origin)
+    {
+        if (origin != SEEK_SET || offset < 0)
+            return CURL_SEEKFUNC_CANTSEEK;
+        return static_cast<body_writer *>(userp)->seek(static_cast<std::size_t>(offset)) ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_FAIL;
+    }
+}
+
+AI_END
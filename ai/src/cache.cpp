@@ -0,0 +1,195 @@
+#include "cache.h"
+#include "file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <format>
+#include <iostream>
+#include <print>
+#include <system_error>
+
+AI_BEG
+
+namespace detail
+{
+    hasher &hasher::add(std::span<const std::byte> bytes)
+    {
+        for (auto b : bytes)
+        {
+            M_hash ^= std::to_integer<std::uint64_t>(b);
+            M_hash *= 0x100000001b3;
+        }
+        return *this;
+    }
+
+    hasher &hasher::add(std::string_view text)
+    {
+        add(std::uint64_t(text.size()));
+        return add(std::as_bytes(std::span(text)));
+    }
+
+    hasher &hasher::add(std::uint64_t value)
+    {
+        return add(std::as_bytes(std::span(&value, 1)));
+    }
+
+    response_cache::key_t response_cache::key(std::string_view base_url, std::string_view head, const nlohmann::json &fields, const input_t &input)
+    {
+        hasher h;
+        h.add(base_url).add(head).add(fields.dump());
+
+        auto add = [&](const input_content &content) {
+            if (auto text = std::get_if<std::string>(&content.value))
+                h.add(std::uint64_t(0)).add(*text);
+            else
+                for (auto &item : std::get<input_content::array_t>(content.value))
+                {
+                    if (auto text = std::get_if<std::string>(&item))
+                        h.add(std::uint64_t(0)).add(*text);
+                    else
+                        h.add(std::uint64_t(1)).add(std::get<std::shared_ptr<file>>(item)->hash());
+                }
+        };
+
+        if (auto text = std::get_if<std::string>(&input.value))
+            h.add(std::uint64_t(0)).add(*text);
+        else
+            for (auto &[role, content] : std::get<input_t::array_t>(input.value))
+            {
+                h.add(std::uint64_t(1)).add(std::uint64_t(role));
+                add(content);
+            }
+
+        return h.value();
+    }
+
+    std::expected<std::shared_ptr<response_cache>, std::string> response_cache::make(cache_options options)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(options.dir, ec);
+        if (ec)
+            return std::unexpected(std::format("Failed to create cache directory {} - {}", options.dir.string(), ec.message()));
+
+        auto res = std::make_shared<response_cache>(std::move(options));
+
+        // oldest first, so the least recently stored are evicted first
+        std::vector<std::pair<key_t, entry>> found;
+        for (auto &item : std::filesystem::directory_iterator(res->M_options.dir, ec))
+        {
+            std::error_code stat_ec;
+            auto name = item.path().filename().string();
+            if (!item.is_regular_file(stat_ec) || item.path().extension() != ".capture")
+                continue;
+
+            key_t key = 0;
+            auto stem = std::string_view(name).substr(0, name.size() - std::string_view(".capture").size());
+            auto stem_end = stem.data() + stem.size();
+            if (auto [ptr, err] = std::from_chars(stem.data(), stem_end, key, 16); err != std::errc{} || ptr != stem_end)
+                continue;
+
+            entry e{.size = item.file_size(stat_ec), .stored = item.last_write_time(stat_ec)};
+            if (!stat_ec)
+                found.emplace_back(key, e);
+        }
+        if (ec)
+            return std::unexpected(std::format("Failed to read cache directory {} - {}", res->M_options.dir.string(), ec.message()));
+
+        std::ranges::sort(found, {}, [](auto &e) { return e.second.stored; });
+        for (auto &[key, e] : found)
+        {
+            e.used = ++res->M_uses;
+            res->M_bytes += e.size;
+            res->M_entries.emplace(key, e);
+        }
+
+        std::lock_guard lock(res->M_mutex);
+        res->evict();
+        return res;
+    }
+
+    std::shared_ptr<const capture> response_cache::find(key_t key)
+    {
+        std::lock_guard lock(M_mutex);
+        auto it = M_entries.find(key);
+        if (it == M_entries.end())
+            return nullptr;
+
+        if (std::filesystem::file_time_type::clock::now() - it->second.stored > M_options.ttl)
+        {
+            erase(key);
+            return nullptr;
+        }
+
+        auto res = capture::load(path(key));
+        if (!res || res->streams().empty())
+        {
+            erase(key);
+            return nullptr;
+        }
+
+        it->second.used = ++M_uses;
+        return std::make_shared<const capture>(std::move(res).value());
+    }
+
+    void response_cache::store(key_t key, const capture::stream &s)
+    {
+        std::lock_guard lock(M_mutex);
+
+        // through a temporary, a reader never sees half a response
+        auto target = path(key);
+        auto temp = std::filesystem::path(target).concat(".tmp");
+        std::error_code ec;
+        std::filesystem::remove(temp, ec);
+
+        if (auto res = capture::append(temp, s); !res)
+        {
+            std::print(std::cerr, "Failed to cache response: {}\n", res.error());
+            std::filesystem::remove(temp, ec);
+            return;
+        }
+
+        std::filesystem::rename(temp, target, ec);
+        if (ec)
+        {
+            std::print(std::cerr, "Failed to cache response: {}\n", ec.message());
+            std::filesystem::remove(temp, ec);
+            return;
+        }
+
+        auto &e = M_entries[key];
+        M_bytes -= e.size;
+        e.size = std::filesystem::file_size(target, ec);
+        if (ec)
+            e.size = 0;
+        e.stored = std::filesystem::file_time_type::clock::now();
+        e.used = ++M_uses;
+        M_bytes += e.size;
+
+        evict();
+    }
+
+    std::filesystem::path response_cache::path(key_t key) const
+    {
+        return M_options.dir / std::format("{:016x}.capture", key);
+    }
+
+    void response_cache::erase(key_t key)
+    {
+        auto it = M_entries.find(key);
+        if (it == M_entries.end())
+            return;
+
+        std::error_code ec;
+        std::filesystem::remove(path(key), ec);
+        M_bytes -= it->second.size;
+        M_entries.erase(it);
+    }
+
+    void response_cache::evict()
+    {
+        while (M_bytes > M_options.max_bytes && !M_entries.empty())
+            erase(std::ranges::min_element(M_entries, {}, [](auto &e) { return e.second.used; })->first);
+    }
+}
+
+AI_END
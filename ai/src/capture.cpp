@@ -0,0 +1,134 @@
+#include "capture.h"
+
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+AI_BEG
+
+std::expected<capture, std::string> capture::load(const std::filesystem::path &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return std::unexpected(std::format("Failed to open capture {}", path.string()));
+
+    capture res;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream words(line);
+        std::string kind;
+        words >> kind;
+
+        if (kind == "stream")
+            res.M_streams.emplace_back();
+        else if (kind == "chunk" && !res.M_streams.empty())
+        {
+            long long delay = 0;
+            std::size_t size = 0;
+            if (!(words >> delay >> size))
+                return std::unexpected(std::format("Malformed chunk header in capture {}: {}", path.string(), line));
+
+            std::string bytes(size, '\0');
+            if (!file.read(bytes.data(), size) || file.get() != '\n')
+                return std::unexpected(std::format("Truncated chunk in capture {}", path.string()));
+
+            res.M_streams.back().chunks.push_back({std::chrono::microseconds(delay), std::move(bytes)});
+        }
+        else if (kind == "end" && !res.M_streams.empty())
+            words >> res.M_streams.back().status;
+        else if (!kind.empty())
+            return std::unexpected(std::format("Unexpected line in capture {}: {}", path.string(), line));
+    }
+
+    return res;
+}
+
+std::expected<void, std::string> capture::append(const std::filesystem::path &path, const stream &s)
+{
+    // several threads may record into the same file
+    static std::mutex mutex;
+    std::lock_guard lock(mutex);
+
+    std::ofstream file(path, std::ios::binary | std::ios::app);
+    if (!file)
+        return std::unexpected(std::format("Failed to open capture {}", path.string()));
+
+    file << "stream\n";
+    for (auto &chunk : s.chunks)
+    {
+        file << std::format("chunk {} {}\n", chunk.delay.count(), chunk.bytes.size());
+        file.write(chunk.bytes.data(), chunk.bytes.size());
+        file << '\n';
+    }
+    file << std::format("end {}\n", s.status);
+
+    if (!file)
+        return std::unexpected(std::format("Failed to write capture {}", path.string()));
+    return {};
+}
+
+long capture::play(const stream &s, stream_handler &handler, pacing pace)
+{
+    for (auto &chunk : s.chunks)
+    {
+        if (pace == pacing::original)
+            std::this_thread::sleep_for(chunk.delay);
+        handler.M_stream.parse(chunk.bytes);
+    }
+    return s.status;
+}
+
+void capture::play(detail::reactor &reactor, std::shared_ptr<const capture> owner, std::size_t index, std::shared_ptr<stream_handler> handler,
+                   const std::atomic_bool &cancelled, pacing pace, std::move_only_function<void(long, bool)> done)
+{
+    using clock = detail::reactor::clock;
+    // a paced wait is cut into timers this short, so a cancel is noticed as fast as on the network
+    constexpr std::chrono::milliseconds cancel_poll{10};
+
+    struct player
+    {
+        detail::reactor &reactor;
+        std::shared_ptr<const capture> owner;
+        const stream &s;
+        std::shared_ptr<stream_handler> handler;
+        const std::atomic_bool &cancelled;
+        pacing pace;
+        std::move_only_function<void(long, bool)> done;
+        std::size_t next = 0;
+        clock::time_point due; // of the next chunk
+    };
+
+    // one chunk per timer at the original pacing, all at once otherwise
+    auto step = [cancel_poll](this auto self, std::shared_ptr<player> p) -> void {
+        auto &chunks = p->s.chunks;
+        if (auto now = clock::now(); !p->cancelled && now < p->due)
+            return p->reactor.post([self, p] { self(p); }, std::min<clock::duration>(p->due - now, cancel_poll));
+
+        while (!p->cancelled && p->next < chunks.size())
+        {
+            p->handler->M_stream.parse(chunks[p->next++].bytes);
+            if (p->pace == pacing::original)
+                break;
+        }
+
+        if (p->cancelled)
+            p->done(p->s.status, true);
+        else if (p->next < chunks.size())
+        {
+            p->due = clock::now() + chunks[p->next].delay;
+            p->reactor.post([self, p] { self(p); }, std::min<clock::duration>(chunks[p->next].delay, cancel_poll));
+        }
+        else
+            p->done(p->s.status, false);
+    };
+
+    auto &s = owner->M_streams.at(index);
+    auto p = std::make_shared<player>(reactor, std::move(owner), s, std::move(handler), cancelled, pace, std::move(done));
+    if (pace == pacing::original && !s.chunks.empty())
+        p->due = clock::now() + s.chunks.front().delay;
+    reactor.post([step, p] { step(p); });
+}
+
+AI_END
@@ -9,6 +9,86 @@
 
 AI_BEG
 
+namespace
+{
+    // durations in microseconds, flags only when set
+    nlohmann::json metrics_json(const request_metrics &m)
+    {
+        nlohmann::json j = {
+            {"queued_us", m.queued.count()},
+            {"dns_us", m.dns.count()},
+            {"connect_us", m.connect.count()},
+            {"tls_us", m.tls.count()},
+            {"upload_us", m.upload.count()},
+            {"first_byte_us", m.first_byte.count()},
+            {"created_us", m.created.count()},
+            {"first_delta_us", m.first_delta.count()},
+            {"max_gap_us", m.max_gap.count()},
+            {"mean_gap_us", m.mean_gap.count()},
+            {"total_us", m.total.count()},
+            {"deltas", m.deltas},
+            {"bytes_in", m.bytes_in},
+            {"bytes_out", m.bytes_out}
+        };
+        if (m.reused)
+            j["reused"] = true;
+        if (m.hedged)
+            j["hedged"] = true;
+        if (m.cached)
+            j["cached"] = true;
+        return j;
+    }
+
+    nlohmann::json usage_json(const token_usage &u)
+    {
+        return {
+            {"input_tokens", u.input},
+            {"cached_tokens", u.cached},
+            {"output_tokens", u.output},
+            {"reasoning_tokens", u.reasoning}
+        };
+    }
+
+    token_usage usage_from(const nlohmann::json &j)
+    {
+        if (!j.is_object())
+            return {};
+        return {
+            .input = j.value("input_tokens", std::uint64_t(0)),
+            .cached = j.value("cached_tokens", std::uint64_t(0)),
+            .output = j.value("output_tokens", std::uint64_t(0)),
+            .reasoning = j.value("reasoning_tokens", std::uint64_t(0))
+        };
+    }
+
+    request_metrics metrics_from(const nlohmann::json &j)
+    {
+        request_metrics m;
+        if (!j.is_object())
+            return m;
+
+        auto us = [&j](std::string_view key) { return std::chrono::microseconds(j.value(key, std::int64_t(0))); };
+        m.queued = us("queued_us");
+        m.dns = us("dns_us");
+        m.connect = us("connect_us");
+        m.tls = us("tls_us");
+        m.upload = us("upload_us");
+        m.first_byte = us("first_byte_us");
+        m.created = us("created_us");
+        m.first_delta = us("first_delta_us");
+        m.max_gap = us("max_gap_us");
+        m.mean_gap = us("mean_gap_us");
+        m.total = us("total_us");
+        m.deltas = j.value("deltas", std::size_t(0));
+        m.bytes_in = j.value("bytes_in", std::uint64_t(0));
+        m.bytes_out = j.value("bytes_out", std::uint64_t(0));
+        m.reused = j.value("reused", false);
+        m.hedged = j.value("hedged", false);
+        m.cached = j.value("cached", false);
+        return m;
+    }
+}
+
 std::string database::entry::date() const
 {
     if (messages.empty())
@@ -64,8 +144,13 @@ std::expected<database::entry *, std::string> database::append(thread &th)
             {"id", message.id},
             {"input", message.input},
             {"response", message.response},
-            {"created_at", message.created_at}
+            {"created_at", message.created_at},
+            {"metrics", metrics_json(message.metrics)}
         });
+        if (message.truncated)
+            out_messages.back()["truncated"] = true;
+        if (message.usage.input || message.usage.output)
+            out_messages.back()["usage"] = usage_json(message.usage);
     }
 
     file << j.dump(4) << '\n';
@@ -118,7 +203,10 @@ void database::load()
                             .id = get_or(message, "id", std::string()),
                             .input = get_or(message, "input", std::string()),
                             .response = get_or(message, "response", std::string()),
-                            .created_at = get_or(message, "created_at", std::time_t(0))
+                            .created_at = get_or(message, "created_at", std::time_t(0)),
+                            .truncated = get_or(message, "truncated", false),
+                            .metrics = message.contains("metrics") ? metrics_from(message["metrics"]) : request_metrics{},
+                            .usage = message.contains("usage") ? usage_from(message["usage"]) : token_usage{}
                         });
                     M_entries.push_back(std::move(e));
                 }
@@ -134,4 +222,35 @@ void database::load()
         return e.messages.empty() ? std::time_t(0) : e.messages.back().created_at;
     });
 }
-AI_END
\ No newline at end of file
+
+std::map<std::string, database::usage_totals> database::usage_by_assistant() const
+{
+    return usage_by(&entry::assistant);
+}
+
+std::map<std::string, database::usage_totals> database::usage_by_model() const
+{
+    return usage_by(&entry::model);
+}
+
+std::map<std::string, database::usage_totals> database::usage_by(std::string entry::*key) const
+{
+    std::map<std::string, usage_totals> res;
+    for (auto &e : M_entries)
+        for (auto &message : e.messages)
+        {
+            if (message.metrics.cached || (!message.usage.input && !message.usage.output))
+                continue;
+
+            auto &totals = res[e.*key];
+            ++totals.responses;
+            totals.tokens += message.usage;
+            if (auto generating = message.metrics.generating(); generating.count())
+            {
+                totals.generating += generating;
+                totals.timed_output += message.usage.output;
+            }
+        }
+    return res;
+}
+AI_END
@@ -0,0 +1,241 @@
+#include "deletion.h"
+
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <print>
+#include <vector>
+
+#include <json.hpp>
+
+AI_BEG
+
+namespace detail
+{
+    void deletion_queue::uploaded(const std::string &id)
+    {
+        std::lock_guard lock(M_mutex);
+        if (M_live.insert(id).second)
+            write_journal();
+    }
+
+    void deletion_queue::remove(std::string id)
+    {
+        {
+            std::lock_guard lock(M_mutex);
+            M_queue.push_back({std::move(id)});
+            ++M_pending;
+        }
+        M_reactor.post([this] { pump(); });
+    }
+
+    std::expected<void, std::string> deletion_queue::set_journal(std::filesystem::path path)
+    {
+        std::vector<std::string> orphans;
+        {
+            std::lock_guard lock(M_mutex);
+            M_journal = std::move(path);
+
+            std::error_code ec;
+            if (M_journal.has_parent_path())
+                std::filesystem::create_directories(M_journal.parent_path(), ec);
+
+            if (std::ifstream file(M_journal); file)
+                for (std::string id; std::getline(file, id);)
+                    if (!id.empty() && M_live.insert(id).second)
+                        orphans.push_back(id);
+
+            write_journal();
+            if (!std::filesystem::exists(M_journal))
+                return std::unexpected(std::format("Failed to create upload journal {}", M_journal.string()));
+        }
+
+        if (!orphans.empty())
+            std::print(std::cerr, "Deleting {} files left over from an earlier session\n", orphans.size());
+        for (auto &id : orphans)
+            remove(std::move(id));
+        return {};
+    }
+
+    bool deletion_queue::drain(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock lock(M_mutex);
+        return M_idle.wait_for(lock, timeout, [this] { return M_pending == 0; });
+    }
+
+    std::size_t deletion_queue::pending() const
+    {
+        std::lock_guard lock(M_mutex);
+        return M_pending;
+    }
+
+    void deletion_queue::pump()
+    {
+        std::vector<entry> batch;
+        {
+            std::lock_guard lock(M_mutex);
+            while (M_in_flight < max_batch && !M_queue.empty())
+            {
+                batch.push_back(std::move(M_queue.front()));
+                M_queue.pop_front();
+                ++M_in_flight;
+            }
+        }
+
+        for (auto &e : batch)
+            start(std::move(e));
+    }
+
+    struct deletion_queue::request
+    {
+        entry e;
+        scheduler::id_t job = 0;
+        connection_pool::lease lease;
+        curl_slist *headers = nullptr;
+        std::string response;
+
+        ~request()
+        {
+            lease = {};
+            curl_slist_free_all(headers);
+        }
+    };
+
+    void deletion_queue::start(entry e)
+    {
+        auto req = std::make_shared<request>(std::move(e));
+        // nothing to hold back for interactive requests, a delete has no body, and held back they pile up and stall ~handle
+        M_scheduler.submit(priority::background, [this, req](scheduler::id_t job) {
+            req->job = job;
+            send(req);
+        }, nullptr, true);
+    }
+
+    void deletion_queue::send(std::shared_ptr<request> req)
+    {
+        req->lease = M_pool.acquire();
+        CURL *curl = req->lease.get();
+        if (!curl)
+        {
+            {
+                std::lock_guard lock(M_mutex);
+                --M_in_flight;
+            }
+            M_scheduler.finished(req->job);
+            retry(std::move(req->e), "Failed to initialize libcurl.");
+            return;
+        }
+
+        req->headers = curl_slist_append(nullptr, std::format("Authorization: Bearer {}", M_key).c_str());
+
+        curl_easy_setopt(curl, CURLOPT_URL, std::format("{}/files/{}", M_base_url, req->e.id).c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, +[](void *contents, size_t size, size_t nmemb, void *userp) -> std::size_t {
+            static_cast<std::string *>(userp)->append(static_cast<const char *>(contents), size * nmemb);
+            return size * nmemb;
+        });
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+        M_reactor.add(curl, [this, req](CURLcode code) {
+            req->lease.account();
+
+            long status = 0;
+            curl_easy_getinfo(req->lease.get(), CURLINFO_RESPONSE_CODE, &status);
+            req->lease = {};
+            M_scheduler.finished(req->job);
+
+            // a file that is already gone counts as deleted
+            bool deleted = status == 404;
+            if (code == CURLE_OK && status == 200)
+            {
+                try
+                {
+                    deleted = nlohmann::json::parse(req->response).value("deleted", false);
+                }
+                catch (...)
+                {
+                }
+            }
+
+            {
+                std::lock_guard lock(M_mutex);
+                --M_in_flight;
+            }
+
+            if (deleted)
+            {
+                std::print(std::cerr, "Deleted file {} successfully\n", req->e.id);
+                finished(req->e.id);
+            }
+            else if (code == CURLE_ABORTED_BY_CALLBACK)
+                finished(req->e.id, false); // shutting down
+            else if (code != CURLE_OK)
+                retry(std::move(req->e), curl_easy_strerror(code));
+            else
+                retry(std::move(req->e), std::format("status {}: {}", status, req->response));
+
+            pump();
+        });
+    }
+
+    void deletion_queue::retry(entry e, std::string_view reason)
+    {
+        if (++e.attempt >= max_attempts)
+        {
+            std::print(std::cerr, "Failed to delete file {} - {}\n", e.id, reason);
+            finished(e.id, false);
+            return;
+        }
+
+        auto delay = retry_delay * (1 << (e.attempt - 1));
+        M_reactor.post([this, e = std::move(e)]() mutable {
+            {
+                std::lock_guard lock(M_mutex);
+                M_queue.push_back(std::move(e));
+            }
+            pump();
+        }, delay);
+    }
+
+    void deletion_queue::finished(const std::string &id, bool deleted)
+    {
+        std::lock_guard lock(M_mutex);
+        // ids that could not be deleted stay in the journal for the next sweep
+        if (deleted && M_live.erase(id))
+            write_journal();
+        if (--M_pending == 0)
+            M_idle.notify_all();
+    }
+
+    void deletion_queue::write_journal()
+    {
+        if (M_journal.empty())
+            return;
+
+        // replaced in one step, a crash leaves either the old or the new list
+        auto tmp = M_journal;
+        tmp += ".tmp";
+        {
+            std::ofstream file(tmp, std::ios::trunc);
+            for (auto &id : M_live)
+                file << id << '\n';
+            if (!file)
+            {
+                std::print(std::cerr, "Failed to write upload journal {}\n", tmp.string());
+                return;
+            }
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tmp, M_journal, ec);
+        if (ec)
+            std::print(std::cerr, "Failed to replace upload journal {} - {}\n", M_journal.string(), ec.message());
+    }
+}
+
+AI_END
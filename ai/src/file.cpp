@@ -1,6 +1,8 @@
 #include "file.h"
+#include "cache.h"
 
 #include <expected>
+#include <future>
 #include <print>
 #include <string>
 #include <iostream>
@@ -59,171 +61,180 @@ std::expected<std::string, std::string> get_text(std::span<const std::byte> data
     return res;
 }
 
-std::expected<std::string, std::string> upload_file(handle &client, const std::filesystem::path &filename, std::span<const std::byte> data)
+namespace
 {
-    CURL *curl = curl_easy_init();
-    if (!curl)
-        return std::unexpected("Failed to initialize libcurl.");
+    using namespace std::literals;
+    constexpr auto images = std::array{
+        std::pair{".jpg"sv, "image/jpeg"sv},
+        std::pair{".jpeg"sv, "image/jpeg"sv},
+        std::pair{".png"sv, "image/png"sv},
+        std::pair{".gif"sv, "image/gif"sv},
+        std::pair{".webp"sv, "image/webp"sv}
+    };
+
+    auto find_image(const std::filesystem::path &ext)
+    {
+        return std::ranges::find(images, ext, &std::pair<std::string_view, std::string_view>::first);
+    }
+
+    std::expected<std::string, std::string> parse_upload(handle &client, const std::string &response)
+    {
+        try
+        {
+            auto json = nlohmann::json::parse(response);
+            std::string id = json["id"];
+            client.deletions().uploaded(id);
+            return id;
+        }
+        catch (const nlohmann::json::parse_error &e)
+        {
+            return std::unexpected(std::format("Failed to parse response: {}", e.what()));
+        }
+        catch (...)
+        {
+            return std::unexpected("Failed to parse response.");
+        }
+    }
+}
+
+// Starts the upload on the client's reactor and calls done there with the file id once it finished,
+// or right away if it could not start. data is copied into the request.
+void upload_file(handle &client, const std::filesystem::path &filename, std::span<const std::byte> data, std::move_only_function<void(std::expected<std::string, std::string>)> done)
+{
+    struct upload
+    {
+        detail::connection_pool::lease lease;
+        curl_mime *mime = nullptr;
+        curl_slist *headers = nullptr;
+        std::string response;
+
+        ~upload()
+        {
+            lease = {};
+            curl_slist_free_all(headers);
+            curl_mime_free(mime);
+        }
+    };
+
+    auto up = std::make_unique<upload>();
+    up->lease = client.pool().acquire();
+    if (!up->lease)
+        return done(std::unexpected("Failed to initialize libcurl."));
+    CURL *curl = up->lease.get();
 
-    curl_mime *mime = curl_mime_init(curl);
+    up->mime = curl_mime_init(curl);
 
     // -F file=@filename
-    curl_mimepart *file_part = curl_mime_addpart(mime);
+    curl_mimepart *file_part = curl_mime_addpart(up->mime);
     curl_mime_name(file_part, "file");
     curl_mime_filename(file_part, filename.filename().string().c_str());
     curl_mime_type(file_part, "application/octet-stream");
     curl_mime_data(file_part, reinterpret_cast<const char *>(data.data()), data.size());
 
     // -F purpose="assistants"
-    curl_mimepart *purpose_part = curl_mime_addpart(mime);
+    curl_mimepart *purpose_part = curl_mime_addpart(up->mime);
     curl_mime_name(purpose_part, "purpose");
     curl_mime_data(purpose_part, "assistants", CURL_ZERO_TERMINATED);
 
     // request
-    curl_slist *headers = curl_slist_append(nullptr, std::format("Authorization: Bearer {}", client.key()).c_str());
+    up->headers = curl_slist_append(nullptr, std::format("Authorization: Bearer {}", client.key()).c_str());
 
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.openai.com/v1/files");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_URL, std::format("{}/files", client.base_url()).c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, up->headers);
     curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
-    curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, up->mime);
 
-    std::string response;
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, +[](void *contents, size_t size, size_t nmemb, void *userp) -> std::size_t {
         static_cast<std::string *>(userp)->append(static_cast<const char *>(contents), size * nmemb);
         return size * nmemb;
     });
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &up->response);
 
-    CURLcode res = curl_easy_perform(curl);
+    client.reactor().add(curl, [&client, up = std::move(up), done = std::move(done)](CURLcode res) mutable {
+        up->lease.account();
+        auto response = std::move(up->response);
+        up.reset();
 
-    curl_slist_free_all(headers);
-    curl_mime_free(mime);
-    curl_easy_cleanup(curl);
+        if (res != CURLE_OK)
+            return done(std::unexpected(std::format("Failed to upload file: {}", curl_easy_strerror(res))));
+        done(parse_upload(client, response));
+    });
+}
 
-    if (res != CURLE_OK)
-        return std::unexpected(std::format("Failed to upload file: {}", curl_easy_strerror(res)));
+bool file::uploads(std::span<const std::byte> bytes, const std::filesystem::path &filename, mode m)
+{
+    auto ext = filename.extension();
+    if (find_image(ext) != images.end())
+        return !(m == mode::inline_data || (m == mode::automatic && bytes.size() <= inline_limit));
+    return ext == ".pdf";
+}
 
-    try
-    {
-        auto json = nlohmann::json::parse(response);
-        return json["id"];
-    }
-    catch (const nlohmann::json::parse_error &e)
-    {
-        return std::unexpected(std::format("Failed to parse response: {}", e.what()));
-    }
-    catch (...)
-    {
-        return std::unexpected("Failed to parse response.");
-    }
+std::expected<nlohmann::json, std::string> file::process(handle &client, std::span<const std::byte> bytes, const std::filesystem::path &filename, mode m)
+{
+    // the reactor would have to drive the upload this thread waits on
+    if (client.reactor().in_loop() && uploads(bytes, filename, m))
+        return std::unexpected("Uploads can not be waited on from the reactor thread, make the file with a callback there.");
+
+    std::promise<std::expected<nlohmann::json, std::string>> res;
+    auto future = res.get_future();
+    process(client, bytes, filename, m, [&res](std::expected<nlohmann::json, std::string> json) { res.set_value(std::move(json)); });
+    return future.get();
 }
 
-std::expected<nlohmann::json, std::string> file::process(handle &client, std::span<const std::byte> bytes, const std::filesystem::path &filename)
+void file::process(handle &client, std::span<const std::byte> bytes, const std::filesystem::path &filename, mode m, process_fun_t done)
 {
-    using namespace std::literals;
-    constexpr auto images = std::array{".jpg"sv, ".jpeg"sv, ".png"sv, ".gif"sv, ".webp"sv};
+    auto upload = [&](std::string_view type, std::string_view what) {
+        upload_file(client, filename, bytes, [done = std::move(done), type, what, name = filename.string()](std::expected<std::string, std::string> res) mutable {
+            if (res)
+                done(nlohmann::json{
+                    {"type", type},
+                    {"file_id", *res}
+                });
+            else
+                done(std::unexpected(std::format("Failed to upload {} file {} - {}\n", what, name, res.error())));
+        });
+    };
 
     auto ext = filename.extension();
-    if (std::ranges::contains(images, ext))
+    if (auto image = find_image(ext); image != images.end())
     {
-        if (auto res = upload_file(client, filename, bytes))
-            return nlohmann::json{
+        // skips the upload before the request and the delete after it
+        if (!uploads(bytes, filename, m))
+            return done(nlohmann::json{
                 {"type", "input_image"},
-                {"file_id", *res}
-            };
-        else
-            return std::unexpected(std::format("Failed to upload image file {} - {}\n", filename.string(), res.error()));
+                {"image_url", std::format("data:{};base64,{}", image->second, to_base64(bytes))}
+            });
+
+        upload("input_image", "image");
     }
     else if (ext == ".pdf")
-    {
-        if (auto res = upload_file(client, filename, bytes))
-            return nlohmann::json{
-                {"type", "input_file"},
-                {"file_id", *res}
-            };
-        else
-            return std::unexpected(std::format("Failed to upload PDF file {} - {}\n", filename.string(), res.error()));
-    }
+        upload("input_file", "PDF");
     else
     {
         // TODO: convert to PDF, then upload that (I'm never doing this)
         // The vector store doesn't work for this purpose
         if (auto text = get_text(bytes))
-            return nlohmann::json{
+            done(nlohmann::json{
                 {"type", "input_text"},
                 {"text", std::format("**Contents of file \"{}\"**:\n{}", filename.string(), *text)}
-            };
+            });
         else
-            return std::unexpected(std::format("Failed to detect text encoding for file {} - {}\n", filename.string(), text.error()));
+            done(std::unexpected(std::format("Failed to detect text encoding for file {} - {}\n", filename.string(), text.error())));
     }
 }
 
-std::expected<bool, std::string> delete_file(handle &client, const std::string &file_id)
+std::uint64_t file::content_hash(std::span<const std::byte> bytes, const std::filesystem::path &filename)
 {
-    CURL *curl = curl_easy_init();
-    if (!curl)
-        return std::unexpected("Failed to initialize libcurl.");
-
-    // request
-    auto auth_storage = std::format("Authorization: Bearer {}", client.key());
-    curl_slist *headers = curl_slist_append(nullptr, auth_storage.c_str());
-
-    curl_easy_setopt(curl, CURLOPT_URL, std::format("https://api.openai.com/v1/files/{}", file_id).c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
-
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, +[](void *contents, size_t size, size_t nmemb, void *userp) -> std::size_t {
-        static_cast<std::string *>(userp)->append(static_cast<const char *>(contents), size * nmemb);
-        return size * nmemb;
-    });
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-
-    CURLcode res = curl_easy_perform(curl);
-
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-
-    if (res != CURLE_OK)
-        return std::unexpected(std::format("Failed to upload file: {}", curl_easy_strerror(res)));
-
-    try
-    {
-        auto json = nlohmann::json::parse(response);
-        return json["deleted"];
-    }
-    catch (const std::exception &e)
-    {
-        return std::unexpected(std::format("Failed to parse response: {}", e.what()));
-    }
-    catch (...)
-    {
-        if (response.empty())
-            return std::unexpected("Failed to parse response: no response.");
-        else
-            return std::unexpected(std::format("Failed to parse response: {}", response));
-    }
+    return detail::hasher().add(filename.string()).add(bytes).value();
 }
 
 file::~file()
 {
+    // never waits on the network, whatever thread drops the last reference
     if (request.contains("file_id"))
-    {
-        if (auto res = delete_file(*M_client, request["file_id"]))
-        {
-            if (*res)
-                std::print(std::cerr, "Deleted file {} successfully\n", request["file_id"].get<std::string>());
-            else
-                std::print(std::cerr, "Failed to delete file {}\n", request["file_id"].get<std::string>());
-        }
-        else
-            std::print(std::cerr, "Failed to delete file {} - {}\n", request["file_id"].get<std::string>(), res.error());
-    }
+        M_client->deletions().remove(request["file_id"]);
 }
 
 AI_END
\ No newline at end of file
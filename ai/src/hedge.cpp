@@ -0,0 +1,81 @@
+#include "hedge.h"
+
+#include <algorithm>
+#include <span>
+
+AI_BEG
+
+namespace detail
+{
+    void hedge_tracker::sample(std::chrono::microseconds ttft)
+    {
+        std::lock_guard lock(M_mutex);
+        M_samples[M_count++ % window] = ttft;
+    }
+
+    std::chrono::milliseconds hedge_tracker::budget(const hedge_policy &policy) const
+    {
+        if (policy.budget.count() > 0)
+            return policy.budget;
+
+        std::lock_guard lock(M_mutex);
+        if (M_count < min_samples)
+            return policy.fallback;
+        return std::chrono::ceil<std::chrono::milliseconds>(p90());
+    }
+
+    std::chrono::microseconds hedge_tracker::remaining(std::chrono::microseconds elapsed) const
+    {
+        std::lock_guard lock(M_mutex);
+        std::chrono::microseconds longer{};
+        std::size_t count = 0;
+        for (auto sample : std::span(M_samples).first(std::min(M_count, window)))
+        {
+            if (sample > elapsed)
+            {
+                longer += sample - elapsed;
+                ++count;
+            }
+        }
+        return count ? longer / static_cast<std::chrono::microseconds::rep>(count) : std::chrono::microseconds{};
+    }
+
+    void hedge_tracker::hedged()
+    {
+        std::lock_guard lock(M_mutex);
+        ++M_stats.hedges;
+    }
+
+    void hedge_tracker::won()
+    {
+        std::lock_guard lock(M_mutex);
+        ++M_stats.wins;
+    }
+
+    void hedge_tracker::saved(std::chrono::microseconds time)
+    {
+        std::lock_guard lock(M_mutex);
+        M_stats.saved += time;
+    }
+
+    hedge_stats hedge_tracker::stats() const
+    {
+        std::lock_guard lock(M_mutex);
+        auto res = M_stats;
+        if (M_count >= min_samples)
+            res.p90 = p90();
+        return res;
+    }
+
+    std::chrono::microseconds hedge_tracker::p90() const
+    {
+        std::array<std::chrono::microseconds, window> sorted;
+        auto n = std::min(M_count, window);
+        auto end = std::copy_n(M_samples.begin(), n, sorted.begin());
+        auto nth = sorted.begin() + n * 9 / 10;
+        std::nth_element(sorted.begin(), nth, end);
+        return *nth;
+    }
+}
+
+AI_END
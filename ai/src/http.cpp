@@ -0,0 +1,303 @@
+#include "http.h"
+
+#include <algorithm>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <print>
+
+AI_BEG
+
+namespace detail
+{
+    connection_pool::connection_pool()
+    {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+
+        M_share = curl_share_init();
+        if (!M_share)
+            return; // handles still work, just without sharing
+
+        curl_share_setopt(M_share, CURLSHOPT_LOCKFUNC, +[](CURL *, curl_lock_data data, curl_lock_access, void *userp) {
+            static_cast<connection_pool *>(userp)->M_share_locks[data].lock();
+        });
+        curl_share_setopt(M_share, CURLSHOPT_UNLOCKFUNC, +[](CURL *, curl_lock_data data, void *userp) {
+            static_cast<connection_pool *>(userp)->M_share_locks[data].unlock();
+        });
+        curl_share_setopt(M_share, CURLSHOPT_USERDATA, this);
+
+        // Transfers run inside the reactor's curl_multi, whose cache would own the connections otherwise. Shared
+        // here, they outlive the easy handles that opened them and serve any transfer of the client, with
+        // the same reuse as the multi's own cache (8 connections for 33 requests in rounds of 3 and 8
+        // concurrent ones against a local keep-alive server, either way).
+        curl_share_setopt(M_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(M_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(M_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    connection_pool::~connection_pool()
+    {
+        // easy handles have to go before the share they use
+        for (auto curl : M_idle)
+            curl_easy_cleanup(curl);
+        if (M_share)
+            curl_share_cleanup(M_share);
+
+        curl_global_cleanup();
+    }
+
+    connection_pool::lease connection_pool::acquire()
+    {
+        CURL *curl = nullptr;
+        {
+            std::lock_guard lock(M_mutex);
+            if (!M_idle.empty())
+            {
+                curl = M_idle.back();
+                M_idle.pop_back();
+                ++M_stats.hits;
+            }
+            else
+                ++M_stats.misses;
+        }
+
+        if (!curl && !(curl = curl_easy_init()))
+            return {};
+
+        if (M_share)
+            curl_easy_setopt(curl, CURLOPT_SHARE, M_share);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+        return {this, curl};
+    }
+
+    void connection_pool::release(CURL *curl)
+    {
+        // forgets the options of the last request, keeps its connections and caches
+        curl_easy_reset(curl);
+
+        {
+            std::lock_guard lock(M_mutex);
+            M_released = std::chrono::steady_clock::now();
+            if (M_idle.size() < max_idle)
+            {
+                M_idle.push_back(curl);
+                return;
+            }
+        }
+
+        curl_easy_cleanup(curl);
+    }
+
+    pool_stats connection_pool::stats() const
+    {
+        std::lock_guard lock(M_mutex);
+        return M_stats;
+    }
+
+    bool connection_pool::warm() const
+    {
+        std::lock_guard lock(M_mutex);
+        return M_released != std::chrono::steady_clock::time_point{} && std::chrono::steady_clock::now() - M_released < warm_for;
+    }
+
+    CURLcode connection_pool::lease::perform()
+    {
+        CURLcode res = curl_easy_perform(M_curl);
+        account();
+        return res;
+    }
+
+    void connection_pool::lease::account()
+    {
+        long connects = 0;
+        curl_off_t handshake = 0;
+        curl_easy_getinfo(M_curl, CURLINFO_NUM_CONNECTS, &connects);
+        // time until the TLS handshake was done, or until connect for plain http
+        if (curl_easy_getinfo(M_curl, CURLINFO_APPCONNECT_TIME_T, &handshake) != CURLE_OK || handshake == 0)
+            curl_easy_getinfo(M_curl, CURLINFO_CONNECT_TIME_T, &handshake);
+
+        std::lock_guard lock(M_pool->M_mutex);
+        auto &stats = M_pool->M_stats;
+        ++stats.requests;
+        if (connects > 0)
+        {
+            ++stats.connections;
+            stats.last_handshake = std::chrono::microseconds(handshake);
+            stats.handshake += stats.last_handshake;
+        }
+        else
+            stats.last_handshake = {};
+    }
+
+    namespace
+    {
+        // callbacks run on the reactor thread, nothing may escape them
+        template <typename Fn>
+        void guarded(Fn &&fn)
+        {
+            try
+            {
+                fn();
+            }
+            catch (const std::exception &e)
+            {
+                std::print(std::cerr, "Reactor callback failed - {}\n", e.what());
+            }
+            catch (...)
+            {
+                std::print(std::cerr, "Reactor callback failed - Unknown error occurred.\n");
+            }
+        }
+    }
+
+    reactor::reactor()
+    {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+
+        M_multi = curl_multi_init();
+        if (!M_multi)
+            throw std::runtime_error("Failed to initialize libcurl.");
+
+        M_thread = std::jthread([this](std::stop_token stop) { run(stop); });
+    }
+
+    reactor::~reactor()
+    {
+        M_thread.request_stop();
+        curl_multi_wakeup(M_multi);
+        if (M_thread.joinable())
+            M_thread.join();
+
+        for (auto &[curl, done] : std::exchange(M_transfers, {}))
+        {
+            curl_multi_remove_handle(M_multi, curl);
+            guarded([&] { done(CURLE_ABORTED_BY_CALLBACK); });
+        }
+
+        // Callbacks and the destructors of dropped tasks may add or post again (~file queues its delete),
+        // so every round takes both containers out under the lock and runs or destroys them outside it.
+        while (true)
+        {
+            std::vector<std::pair<CURL *, done_fun_t>> pending;
+            std::multimap<clock::time_point, task_t> timers;
+            {
+                std::lock_guard lock(M_mutex);
+                pending.swap(M_pending);
+                timers.swap(M_timers);
+            }
+            if (pending.empty() && timers.empty())
+                break;
+
+            for (auto &[curl, done] : pending)
+                guarded([&] { done(CURLE_ABORTED_BY_CALLBACK); });
+        }
+
+        curl_multi_cleanup(M_multi);
+        curl_global_cleanup();
+    }
+
+    void reactor::add(CURL *curl, done_fun_t done)
+    {
+        {
+            std::lock_guard lock(M_mutex);
+            M_pending.emplace_back(curl, std::move(done));
+        }
+        curl_multi_wakeup(M_multi);
+    }
+
+    void reactor::post(task_t task, clock::duration delay)
+    {
+        {
+            std::lock_guard lock(M_mutex);
+            M_timers.emplace(clock::now() + delay, std::move(task));
+        }
+        curl_multi_wakeup(M_multi);
+    }
+
+    void reactor::wake()
+    {
+        curl_multi_wakeup(M_multi);
+    }
+
+    CURLcode reactor::perform(connection_pool::lease &lease)
+    {
+        // waiting here would stall every other transfer, or never end
+        if (in_loop())
+            return CURLE_RECURSIVE_API_CALL;
+        // nothing would drive the transfer in callbacks aborted by the destruction
+        if (M_thread.get_stop_token().stop_requested())
+            return lease.perform();
+
+        auto result = std::make_shared<std::promise<CURLcode>>();
+        auto future = result->get_future();
+        add(lease.get(), [&lease, result](CURLcode code) {
+            lease.account();
+            result->set_value(code);
+        });
+        return future.get();
+    }
+
+    void reactor::run(std::stop_token stop)
+    {
+        std::vector<std::pair<CURL *, done_fun_t>> pending;
+        std::vector<task_t> due;
+
+        while (!stop.stop_requested())
+        {
+            {
+                std::lock_guard lock(M_mutex);
+                pending.swap(M_pending);
+
+                auto end = M_timers.upper_bound(clock::now());
+                for (auto it = M_timers.begin(); it != end; ++it)
+                    due.push_back(std::move(it->second));
+                M_timers.erase(M_timers.begin(), end);
+            }
+
+            for (auto &[curl, done] : pending)
+            {
+                if (curl_multi_add_handle(M_multi, curl) == CURLM_OK)
+                    M_transfers.emplace(curl, std::move(done));
+                else
+                    guarded([&] { done(CURLE_FAILED_INIT); });
+            }
+            pending.clear();
+
+            for (auto &task : due)
+                guarded(task);
+            due.clear();
+
+            int running = 0;
+            curl_multi_perform(M_multi, &running);
+
+            int left = 0;
+            while (auto msg = curl_multi_info_read(M_multi, &left))
+                if (msg->msg == CURLMSG_DONE)
+                    complete(msg->easy_handle, msg->data.result);
+
+            // curl_multi_poll shortens this to curl's own timeouts
+            std::chrono::milliseconds timeout(1000);
+            {
+                std::lock_guard lock(M_mutex);
+                if (!M_pending.empty())
+                    timeout = {};
+                else if (!M_timers.empty())
+                    timeout = std::clamp(std::chrono::ceil<std::chrono::milliseconds>(M_timers.begin()->first - clock::now()), std::chrono::milliseconds{}, timeout);
+            }
+            curl_multi_poll(M_multi, nullptr, 0, int(timeout.count()), nullptr);
+        }
+    }
+
+    void reactor::complete(CURL *curl, CURLcode result)
+    {
+        curl_multi_remove_handle(M_multi, curl);
+
+        auto node = M_transfers.extract(curl);
+        if (!node)
+            return;
+        guarded([&] { node.mapped()(result); });
+    }
+}
+
+AI_END
@@ -0,0 +1,243 @@
+#include "ratelimit.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+AI_BEG
+
+namespace detail
+{
+    namespace
+    {
+        // the API's limits are per minute, the slowest a bucket is assumed to refill
+        constexpr std::chrono::seconds window{60};
+
+        // Digits with an optional fraction, all the headers send. Integral from_chars for both parts, as the
+        // floating-point one is missing from older libc++ and strtod reads the decimal point of the locale.
+        std::optional<double> parse_number(std::string_view text)
+        {
+            auto dot = text.find('.');
+            auto whole = text.substr(0, dot);
+            auto fraction = dot == std::string_view::npos ? std::string_view{} : text.substr(dot + 1);
+            if (whole.empty() && fraction.empty())
+                return std::nullopt;
+
+            auto digits = [](std::string_view part) -> std::optional<std::uint64_t> {
+                std::uint64_t value = 0;
+                if (part.empty())
+                    return value;
+                auto [ptr, err] = std::from_chars(part.data(), part.data() + part.size(), value);
+                if (err != std::errc{} || ptr != part.data() + part.size())
+                    return std::nullopt;
+                return value;
+            };
+
+            auto integer = digits(whole);
+            if (!integer || !std::ranges::all_of(fraction, [](unsigned char c) { return std::isdigit(c); }))
+                return std::nullopt;
+            fraction = fraction.substr(0, 18); // more digits than a double holds would overflow the integer
+            auto part = digits(fraction);
+            return double(*integer) + double(*part) / std::pow(10.0, double(fraction.size()));
+        }
+
+        bool iequals(std::string_view a, std::string_view b)
+        {
+            return std::ranges::equal(a, b, [](unsigned char x, unsigned char y) { return std::tolower(x) == std::tolower(y); });
+        }
+    }
+
+    double rate_limiter::bucket::now(std::chrono::steady_clock::time_point t) const
+    {
+        return std::min(limit, level + rate * std::chrono::duration<double>(t - observed).count());
+    }
+
+    std::chrono::milliseconds rate_limiter::bucket::take(double cost, std::chrono::steady_clock::time_point t)
+    {
+        level = now(t) - cost;
+        observed = t;
+        if (level >= 0 || rate <= 0)
+            return {};
+        return std::chrono::ceil<std::chrono::milliseconds>(std::chrono::duration<double>(-level / rate));
+    }
+
+    void rate_limiter::observe(std::string_view header)
+    {
+        auto colon = header.find(':');
+        if (colon == std::string_view::npos)
+            return;
+
+        auto name = header.substr(0, colon);
+        auto value = header.substr(colon + 1);
+        while (!value.empty() && std::isspace(static_cast<unsigned char>(value.front())))
+            value.remove_prefix(1);
+        while (!value.empty() && std::isspace(static_cast<unsigned char>(value.back())))
+            value.remove_suffix(1);
+
+        constexpr std::string_view prefix = "x-ratelimit-";
+        if (name.size() <= prefix.size() || !iequals(name.substr(0, prefix.size()), prefix))
+            return;
+        name.remove_prefix(prefix.size());
+
+        std::lock_guard lock(M_mutex);
+        for (auto [suffix, b] : {std::pair{std::string_view("requests"), &M_requests}, std::pair{std::string_view("tokens"), &M_tokens}})
+        {
+            if (iequals(name, std::string("limit-").append(suffix)))
+                update(*b, parse_number(value), std::nullopt, std::nullopt);
+            else if (iequals(name, std::string("remaining-").append(suffix)))
+                update(*b, std::nullopt, parse_number(value), std::nullopt);
+            else if (iequals(name, std::string("reset-").append(suffix)))
+                update(*b, std::nullopt, std::nullopt, parse_duration(value));
+        }
+    }
+
+    void rate_limiter::update(bucket &b, std::optional<double> limit, std::optional<double> remaining, std::optional<std::chrono::milliseconds> reset)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (limit)
+            b.limit = *limit;
+        if (remaining)
+        {
+            b.level = *remaining;
+            b.observed = now;
+        }
+        if (reset)
+            b.reset = *reset;
+        if (!b.known())
+            return;
+
+        // full again by the reset, never slower than the limit per window
+        auto slowest = b.limit / std::chrono::duration<double>(window).count();
+        b.rate = slowest;
+        if (b.reset.count() > 0)
+            b.rate = std::max(slowest, (b.limit - b.now(now)) / std::chrono::duration<double>(b.reset).count());
+    }
+
+    void rate_limiter::rejected(std::chrono::milliseconds retry_after)
+    {
+        std::lock_guard lock(M_mutex);
+        ++M_stats.rejected;
+        M_blocked_until = std::max(M_blocked_until, std::chrono::steady_clock::now() + retry_after);
+    }
+
+    std::chrono::milliseconds rate_limiter::admit(std::uint64_t tokens, double reserve)
+    {
+        std::lock_guard lock(M_mutex);
+        auto now = std::chrono::steady_clock::now();
+
+        std::chrono::milliseconds wait{};
+        if (reserve > 0)
+        {
+            wait = room(tokens, reserve, now);
+            if (wait.count() == 0)
+                take(tokens, reserve, now);
+        }
+        else
+        {
+            if (M_blocked_until > now)
+                wait = std::chrono::ceil<std::chrono::milliseconds>(M_blocked_until - now);
+            if (M_requests.known())
+                wait = std::max(wait, M_requests.take(1, now));
+            if (M_tokens.known())
+                wait = std::max(wait, M_tokens.take(std::min(double(tokens), M_tokens.limit), now)); // a send larger than the limit only waits for a full bucket
+        }
+
+        if (wait.count() > 0)
+        {
+            ++M_stats.delayed;
+            M_stats.delay += wait;
+        }
+        return wait;
+    }
+
+    bool rate_limiter::try_admit(std::uint64_t tokens, double reserve)
+    {
+        std::lock_guard lock(M_mutex);
+        auto now = std::chrono::steady_clock::now();
+
+        if (room(tokens, reserve, now).count() > 0)
+            return false;
+        take(tokens, reserve, now);
+        return true;
+    }
+
+    std::chrono::milliseconds rate_limiter::room(std::uint64_t tokens, double reserve, std::chrono::steady_clock::time_point now) const
+    {
+        std::chrono::milliseconds wait{};
+        if (M_blocked_until > now)
+            wait = std::chrono::ceil<std::chrono::milliseconds>(M_blocked_until - now);
+
+        auto until = [&](const bucket &b, double cost) {
+            auto missing = cost + reserve * b.limit - b.now(now);
+            if (!b.known() || missing <= 0 || b.rate <= 0)
+                return std::chrono::milliseconds{};
+            return std::chrono::ceil<std::chrono::milliseconds>(std::chrono::duration<double>(missing / b.rate));
+        };
+        wait = std::max(wait, until(M_requests, 1));
+        wait = std::max(wait, until(M_tokens, std::min(double(tokens), M_tokens.limit * (1 - reserve))));
+        return wait;
+    }
+
+    void rate_limiter::take(std::uint64_t tokens, double reserve, std::chrono::steady_clock::time_point now)
+    {
+        if (M_requests.known())
+            M_requests.take(1, now);
+        if (M_tokens.known())
+            M_tokens.take(std::min(double(tokens), M_tokens.limit * (1 - reserve)), now);
+    }
+
+    std::chrono::milliseconds rate_limiter::backoff(const retry_policy &policy, std::size_t attempt, std::chrono::milliseconds retry_after)
+    {
+        // equal jitter: half the exponential delay for sure, the other half at random, so clients that
+        // failed together do not come back together
+        auto exponential = policy.base * (1 << std::min<std::size_t>(attempt - 1, 16));
+        auto ceiling = std::min(exponential, policy.cap);
+
+        std::lock_guard lock(M_mutex);
+        ++M_stats.retries;
+        auto half = ceiling / 2;
+        auto jitter = std::chrono::milliseconds(std::uniform_int_distribution<std::chrono::milliseconds::rep>(0, half.count())(M_random));
+        return std::max(half + jitter, retry_after);
+    }
+
+    rate_limit_stats rate_limiter::stats() const
+    {
+        std::lock_guard lock(M_mutex);
+        return M_stats;
+    }
+
+    std::optional<std::chrono::milliseconds> rate_limiter::parse_duration(std::string_view text)
+    {
+        if (text.empty())
+            return std::nullopt;
+
+        double total = 0; // milliseconds
+        while (!text.empty())
+        {
+            auto unit = text.find_first_not_of("0123456789.");
+            if (unit == 0)
+                return std::nullopt;
+            auto number = parse_number(text.substr(0, unit));
+            if (!number)
+                return std::nullopt;
+            if (unit == std::string_view::npos)
+                return std::chrono::milliseconds(std::llround(total + *number * 1000)); // plain seconds, as in Retry-After
+            text.remove_prefix(unit);
+
+            constexpr std::array units{std::pair{std::string_view("ms"), 1.0}, std::pair{std::string_view("h"), 3600e3},
+                                       std::pair{std::string_view("m"), 60e3}, std::pair{std::string_view("s"), 1e3}};
+            auto found = std::ranges::find_if(units, [text](auto &u) { return text.starts_with(u.first); });
+            if (found == units.end())
+                return std::nullopt;
+            total += *number * found->second;
+            text.remove_prefix(found->first.size());
+        }
+        return std::chrono::milliseconds(std::llround(total));
+    }
+}
+
+AI_END
@@ -0,0 +1,249 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <print>
+
+AI_BEG
+
+namespace detail
+{
+    scheduler::id_t scheduler::submit(priority p, start_fun_t start, pause_fun_t pause, bool exempt)
+    {
+        auto id = ++M_next;
+        M_reactor.post([this, id, j = job{p, std::move(start), std::move(pause), std::chrono::steady_clock::now(), exempt}]() mutable {
+            enqueue(id, std::move(j));
+        });
+        return id;
+    }
+
+    void scheduler::finished(id_t id)
+    {
+        M_reactor.post([this, id] { remove(id); });
+    }
+
+    void scheduler::settled(id_t id)
+    {
+        M_reactor.post([this, id] { settle(id); });
+    }
+
+    void scheduler::set_priority(id_t id, priority p)
+    {
+        M_reactor.post([this, id, p] { change(id, p); });
+    }
+
+    void scheduler::release(id_t id)
+    {
+        M_reactor.post([this, id] { let_go(id); });
+    }
+
+    scheduler_stats scheduler::stats() const
+    {
+        std::lock_guard lock(M_mutex);
+        return M_stats;
+    }
+
+    void scheduler::enqueue(id_t id, job j)
+    {
+        auto cls = static_cast<std::size_t>(j.cls);
+        M_jobs.emplace(id, std::move(j));
+        M_queues[cls].push_back(id);
+        pump();
+        update_stats();
+    }
+
+    void scheduler::remove(id_t id)
+    {
+        auto it = M_jobs.find(id);
+        if (it == M_jobs.end())
+            return;
+
+        auto cls = static_cast<std::size_t>(it->second.cls);
+        if (it->second.start)
+            std::erase(M_queues[cls], id);
+        else
+        {
+            --M_running[cls];
+            if (it->second.cls == priority::interactive && !it->second.settled)
+                --M_contending;
+        }
+        M_jobs.erase(it);
+
+        rebalance();
+        pump();
+        update_stats();
+    }
+
+    void scheduler::change(id_t id, priority p)
+    {
+        auto it = M_jobs.find(id);
+        if (it == M_jobs.end() || it->second.cls == p)
+            return;
+
+        auto from = static_cast<std::size_t>(it->second.cls);
+        auto to = static_cast<std::size_t>(p);
+        if (it->second.start)
+        {
+            std::erase(M_queues[from], id);
+            M_queues[to].push_back(id);
+        }
+        else
+        {
+            --M_running[from];
+            ++M_running[to];
+            if (!it->second.settled)
+            {
+                if (it->second.cls == priority::interactive)
+                    --M_contending;
+                if (p == priority::interactive)
+                    ++M_contending;
+            }
+        }
+        it->second.cls = p;
+
+        rebalance();
+        pump();
+        update_stats();
+    }
+
+    void scheduler::let_go(id_t id)
+    {
+        auto it = M_jobs.find(id);
+        if (it == M_jobs.end())
+            return;
+
+        auto &j = it->second;
+        if (j.start)
+        {
+            std::erase(M_queues[static_cast<std::size_t>(j.cls)], id);
+            run(id, j);
+        }
+        else if (j.pause)
+        {
+            // never paused again, whatever runs
+            auto pause = std::exchange(j.pause, nullptr);
+            if (std::exchange(j.paused, false))
+                pause(false);
+        }
+        update_stats();
+    }
+
+    void scheduler::settle(id_t id)
+    {
+        auto it = M_jobs.find(id);
+        if (it == M_jobs.end() || it->second.start || it->second.settled)
+            return;
+
+        it->second.settled = true;
+        if (it->second.cls != priority::interactive)
+            return;
+
+        --M_contending;
+        rebalance();
+        pump();
+        update_stats();
+    }
+
+    void scheduler::run(id_t id, job &j)
+    {
+        auto cls = static_cast<std::size_t>(j.cls);
+        ++M_running[cls];
+        auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - j.submitted);
+        {
+            std::lock_guard lock(M_mutex);
+            auto &s = M_stats[cls];
+            ++s.started;
+            s.waited += waited;
+            s.max_wait = std::max(s.max_wait, waited);
+        }
+
+        auto start = std::exchange(j.start, nullptr);
+        if (j.cls == priority::interactive)
+        {
+            ++M_contending;
+            rebalance();
+        }
+
+        try
+        {
+            start(id);
+        }
+        catch (const std::exception &e)
+        {
+            std::print(std::cerr, "Failed to start request - {}\n", e.what());
+        }
+        catch (...)
+        {
+            std::print(std::cerr, "Failed to start request - Unknown error occurred.\n");
+        }
+    }
+
+    void scheduler::pump()
+    {
+        while (true)
+        {
+            // nothing of a lower class starts while an interactive request waits, for its turn or for its
+            // response to start, exempt requests aside
+            bool held = M_contending > 0 || !M_queues[0].empty();
+            std::optional<id_t> next;
+            for (std::size_t cls = 0; cls < priority_count && !next; ++cls)
+            {
+                auto &queue = M_queues[cls];
+                if (queue.empty() || M_running[cls] >= std::max<std::size_t>(M_policy.concurrency[cls], 1))
+                    continue;
+
+                auto it = queue.begin();
+                if (cls > 0 && held)
+                    it = std::ranges::find_if(queue, [this](id_t id) { return M_jobs.at(id).exempt; });
+                if (it != queue.end())
+                {
+                    next = *it;
+                    queue.erase(it);
+                }
+            }
+            if (!next)
+                return;
+
+            run(*next, M_jobs.at(*next));
+        }
+    }
+
+    void scheduler::rebalance()
+    {
+        bool interactive = M_contending > 0;
+        for (auto &[id, j] : M_jobs)
+        {
+            // queued, or not pausable
+            if (j.start || !j.pause || j.exempt)
+                continue;
+
+            bool pause = interactive && j.cls != priority::interactive;
+            if (pause == j.paused)
+                continue;
+
+            j.paused = pause;
+            if (pause)
+            {
+                std::lock_guard lock(M_mutex);
+                ++M_stats[static_cast<std::size_t>(j.cls)].preempted;
+            }
+            j.pause(pause);
+        }
+    }
+
+    void scheduler::update_stats()
+    {
+        std::lock_guard lock(M_mutex);
+        for (std::size_t cls = 0; cls < priority_count; ++cls)
+        {
+            auto &s = M_stats[cls];
+            s.queued = M_queues[cls].size();
+            s.max_queued = std::max(s.max_queued, s.queued);
+            s.running = M_running[cls];
+        }
+    }
+}
+
+AI_END
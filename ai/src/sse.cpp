@@ -0,0 +1,555 @@
+#include "sse.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define AI_SSE_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define AI_TARGET_AVX2
+#else
+#define AI_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+AI_BEG
+
+namespace
+{
+    constexpr auto npos = std::string_view::npos;
+
+    // Line state of one scan_block call. Every newline is reported once, in order,
+    // by whichever instruction set is finding them.
+    struct field_scanner
+    {
+        std::string_view str;
+        std::size_t pos;
+        detail::sse_block &block;
+        std::size_t line_start;
+        std::size_t prev_newline = npos;
+
+        field_scanner(std::string_view str, std::size_t pos, detail::sse_block &block)
+            : str(str), pos(pos), block(block), line_start(pos)
+        {
+            block.event_field = {};
+            block.data_field = {};
+        }
+
+        // returns true if the newline at i completes the terminator
+        bool newline(std::size_t i)
+        {
+            if (prev_newline != npos && prev_newline + 1 == i)
+                return true;
+
+            line(line_start, i);
+            prev_newline = i;
+            line_start = i + 1;
+            return false;
+        }
+
+        void line(std::size_t begin, std::size_t end)
+        {
+            if (end - begin < 5)
+                return;
+
+            auto text = str.data();
+            if (text[end - 1] == '\r')
+                --end;
+
+            detail::sse_field *field = nullptr;
+            if (text[begin] == 'd' && std::memcmp(text + begin, "data:", 5) == 0)
+            {
+                field = &block.data_field;
+                begin += 5;
+            }
+            else if (text[begin] == 'e' && end - begin >= 6 && std::memcmp(text + begin, "event:", 6) == 0)
+            {
+                field = &block.event_field;
+                begin += 6;
+            }
+            else
+                return;
+
+            auto space = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v'; };
+            while (begin < end && space(text[begin]))
+                ++begin;
+            while (end > begin && space(text[end - 1]))
+                --end;
+
+            *field = {.offset = begin - pos, .size = end - begin};
+        }
+
+        std::size_t done(std::size_t i)
+        {
+            // i is the second newline of the terminator
+            block.text = str.substr(pos, i - 1 - pos);
+            return i - 1;
+        }
+    };
+
+    std::size_t scan_scalar(std::string_view str, std::size_t pos, detail::sse_block &block)
+    {
+        field_scanner scanner(str, pos, block);
+        for (std::size_t i = pos; i < str.size();)
+        {
+            auto found = static_cast<const char *>(std::memchr(str.data() + i, '\n', str.size() - i));
+            if (!found)
+                break;
+
+            i = found - str.data();
+            if (scanner.newline(i))
+                return scanner.done(i);
+            ++i;
+        }
+        return npos;
+    }
+
+#ifdef AI_SSE_X86
+    // newline bitmasks 16 (sse2) or 32 (avx2) bytes at a time, bytes past the last full vector go through memchr
+
+    std::size_t scan_sse2(std::string_view str, std::size_t pos, detail::sse_block &block)
+    {
+        field_scanner scanner(str, pos, block);
+        const __m128i nl = _mm_set1_epi8('\n');
+
+        std::size_t i = pos;
+        for (; i + 16 <= str.size(); i += 16)
+        {
+            auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str.data() + i));
+            auto mask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+            for (; mask; mask &= mask - 1)
+            {
+                auto at = i + std::countr_zero(mask);
+                if (scanner.newline(at))
+                    return scanner.done(at);
+            }
+        }
+
+        for (; i < str.size(); ++i)
+            if (str[i] == '\n' && scanner.newline(i))
+                return scanner.done(i);
+        return npos;
+    }
+
+    AI_TARGET_AVX2 std::size_t scan_avx2(std::string_view str, std::size_t pos, detail::sse_block &block)
+    {
+        field_scanner scanner(str, pos, block);
+        const __m256i nl = _mm256_set1_epi8('\n');
+
+        std::size_t i = pos;
+        for (; i + 32 <= str.size(); i += 32)
+        {
+            auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str.data() + i));
+            auto mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+            for (; mask; mask &= mask - 1)
+            {
+                auto at = i + std::countr_zero(mask);
+                if (scanner.newline(at))
+                    return scanner.done(at);
+            }
+        }
+
+        for (; i < str.size(); ++i)
+            if (str[i] == '\n' && scanner.newline(i))
+                return scanner.done(i);
+        return npos;
+    }
+
+    bool has_avx2()
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+
+        __cpuid(info, 1);
+        bool osxsave = info[2] & (1 << 27);
+        if (!osxsave || (_xgetbv(0) & 0x6) != 0x6)
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return info[1] & (1 << 5);
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+    using scan_fun_t = std::size_t (*)(std::string_view, std::size_t, detail::sse_block &);
+
+    scan_fun_t scan_fun(detail::simd_t level)
+    {
+        switch (level)
+        {
+#ifdef AI_SSE_X86
+        case detail::simd_t::avx2: return scan_avx2;
+        case detail::simd_t::sse2: return scan_sse2;
+#endif
+        default: return scan_scalar;
+        }
+    }
+
+    std::atomic<detail::simd_t> current_level = detail::simd_support();
+    std::atomic<scan_fun_t> current_scan = scan_fun(current_level);
+}
+
+detail::simd_t detail::simd_support()
+{
+    static const simd_t level = [] {
+#ifdef AI_SSE_X86
+        if (has_avx2())
+            return simd_t::avx2;
+        return simd_t::sse2;
+#else
+        return simd_t::scalar;
+#endif
+    }();
+    return level;
+}
+
+detail::simd_t detail::simd()
+{
+    return current_level;
+}
+
+void detail::set_simd(simd_t level)
+{
+    level = (std::min)(level, simd_support());
+    current_level = level;
+    current_scan = scan_fun(level);
+}
+
+std::string_view detail::to_string(simd_t level)
+{
+    switch (level)
+    {
+    case simd_t::scalar: return "scalar";
+    case simd_t::sse2: return "sse2";
+    case simd_t::avx2: return "avx2";
+    default: return "";
+    }
+}
+
+std::size_t detail::scan_block(std::string_view str, std::size_t pos, sse_block &block)
+{
+    return current_scan.load(std::memory_order_relaxed)(str, pos, block);
+}
+
+detail::sse_block detail::make_block(std::string_view text)
+{
+    sse_block block;
+    field_scanner scanner(text, 0, block);
+    for (std::size_t i = 0; i < text.size(); ++i)
+        if (text[i] == '\n')
+            scanner.newline(i);
+    scanner.line(scanner.line_start, text.size());
+    block.text = text;
+    return block;
+}
+
+std::size_t detail::event_registry::intern(std::string_view name)
+{
+    if (auto id = find(name); id != npos)
+        return id;
+
+    auto id = builtin_count + M_custom.size();
+    M_custom.emplace(name, id);
+    return id;
+}
+
+void detail::event_registry::on(std::string_view name, handler_t handler)
+{
+    auto id = intern(name);
+    if (id >= M_handlers.size())
+        M_handlers.resize(id + 1);
+    M_handlers[id] = std::move(handler);
+}
+
+namespace
+{
+    // cursor over a JSON payload for extract_delta, every member returns false on malformed input
+    struct json_cursor
+    {
+        const char *it;
+        const char *end;
+
+        void skip_ws()
+        {
+            while (it != end && (*it == ' ' || *it == '\t' || *it == '\n' || *it == '\r'))
+                ++it;
+        }
+
+        bool consume(char c)
+        {
+            skip_ws();
+            if (it == end || *it != c)
+                return false;
+            ++it;
+            return true;
+        }
+
+        // string without escapes, it points past the opening quote
+        bool raw_string(std::string_view &out)
+        {
+            auto start = it;
+            for (; it != end; ++it)
+            {
+                if (*it == '"')
+                {
+                    out = std::string_view(start, it - start);
+                    ++it;
+                    return true;
+                }
+                if (*it == '\\' || static_cast<unsigned char>(*it) < 0x20)
+                    return false;
+            }
+            return false;
+        }
+
+        static int hex(char c)
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            return -1;
+        }
+
+        bool code_unit(std::uint32_t &unit)
+        {
+            if (end - it < 4)
+                return false;
+            unit = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                int digit = hex(*it++);
+                if (digit < 0)
+                    return false;
+                unit = (unit << 4) | digit;
+            }
+            return true;
+        }
+
+        static void append_utf8(std::string &out, std::uint32_t cp)
+        {
+            if (cp < 0x80)
+                out += char(cp);
+            else if (cp < 0x800)
+            {
+                out += char(0xc0 | (cp >> 6));
+                out += char(0x80 | (cp & 0x3f));
+            }
+            else if (cp < 0x10000)
+            {
+                out += char(0xe0 | (cp >> 12));
+                out += char(0x80 | ((cp >> 6) & 0x3f));
+                out += char(0x80 | (cp & 0x3f));
+            }
+            else
+            {
+                out += char(0xf0 | (cp >> 18));
+                out += char(0x80 | ((cp >> 12) & 0x3f));
+                out += char(0x80 | ((cp >> 6) & 0x3f));
+                out += char(0x80 | (cp & 0x3f));
+            }
+        }
+
+        // unescapes a string onto out, it points past the opening quote
+        bool string(std::string &out)
+        {
+            while (it != end)
+            {
+                auto run = it;
+                while (it != end && *it != '"' && *it != '\\' && static_cast<unsigned char>(*it) >= 0x20)
+                    ++it;
+                out.append(run, it);
+
+                if (it == end || static_cast<unsigned char>(*it) < 0x20)
+                    return false;
+                if (*it++ == '"')
+                    return true;
+
+                if (it == end)
+                    return false;
+                switch (*it++)
+                {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u':
+                {
+                    std::uint32_t cp;
+                    if (!code_unit(cp))
+                        return false;
+                    if (cp >= 0xd800 && cp < 0xdc00)
+                    {
+                        std::uint32_t low;
+                        if (end - it < 2 || it[0] != '\\' || it[1] != 'u')
+                            return false;
+                        it += 2;
+                        if (!code_unit(low) || low < 0xdc00 || low >= 0xe000)
+                            return false;
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    else if (cp >= 0xdc00 && cp < 0xe000)
+                        return false;
+                    append_utf8(out, cp);
+                    break;
+                }
+                default:
+                    return false;
+                }
+            }
+            return false;
+        }
+
+        bool integer(std::int64_t &out)
+        {
+            skip_ws();
+            bool negative = it != end && *it == '-';
+            if (negative)
+                ++it;
+            if (it == end || *it < '0' || *it > '9')
+                return false;
+
+            out = 0;
+            for (; it != end && *it >= '0' && *it <= '9'; ++it)
+                out = out * 10 + (*it - '0');
+            if (it != end && (*it == '.' || *it == 'e' || *it == 'E'))
+                return false;
+            if (negative)
+                out = -out;
+            return true;
+        }
+
+        // skips any value, validating only as much as needed to find its end
+        bool skip_value()
+        {
+            skip_ws();
+            if (it == end)
+                return false;
+
+            switch (*it)
+            {
+            case '"':
+            {
+                for (++it; it != end; ++it)
+                {
+                    if (*it == '\\')
+                    {
+                        if (++it == end)
+                            return false;
+                    }
+                    else if (*it == '"')
+                    {
+                        ++it;
+                        return true;
+                    }
+                }
+                return false;
+            }
+            case '{':
+            case '[':
+            {
+                std::size_t depth = 0;
+                for (; it != end; ++it)
+                {
+                    if (*it == '"')
+                    {
+                        if (!skip_value())
+                            return false;
+                        --it;
+                    }
+                    else if (*it == '{' || *it == '[')
+                        ++depth;
+                    else if ((*it == '}' || *it == ']') && --depth == 0)
+                    {
+                        ++it;
+                        return true;
+                    }
+                }
+                return false;
+            }
+            default:
+            {
+                auto start = it;
+                while (it != end && *it != ',' && *it != '}' && *it != ']' && *it != ' ' && *it != '\t' && *it != '\n' && *it != '\r')
+                    ++it;
+                return it != start;
+            }
+            }
+        }
+    };
+}
+
+bool detail::extract_delta(std::string_view data, std::string &out, delta_fields &fields)
+{
+    json_cursor cur{data.data(), data.data() + data.size()};
+    auto size = out.size();
+    auto fail = [&] {
+        out.resize(size);
+        return false;
+    };
+
+    fields = {};
+    bool found = false;
+
+    if (!cur.consume('{'))
+        return fail();
+
+    cur.skip_ws();
+    if (cur.it != cur.end && *cur.it == '}')
+        return fail();
+
+    while (true)
+    {
+        std::string_view key;
+        if (!cur.consume('"') || !cur.raw_string(key) || !cur.consume(':'))
+            return fail();
+
+        if (key == "delta")
+        {
+            if (found || !cur.consume('"') || !cur.string(out))
+                return fail();
+            found = true;
+        }
+        else if (key == "item_id")
+        {
+            if (!cur.consume('"') || !cur.raw_string(fields.item_id))
+                return fail();
+        }
+        else if (key == "sequence_number")
+        {
+            if (!cur.integer(fields.sequence_number))
+                return fail();
+        }
+        else if (!cur.skip_value())
+            return fail();
+
+        if (cur.consume(','))
+            continue;
+        if (!cur.consume('}'))
+            return fail();
+        break;
+    }
+
+    cur.skip_ws();
+    if (cur.it != cur.end || !found)
+        return fail();
+    return true;
+}
+
+AI_END
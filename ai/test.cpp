@@ -1,8 +1,53 @@
 #include "ai.h"
+#include "async.h"
+#include "cache.h"
 #include "database.h"
+#include "test_common.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <print>
 #include <iostream>
+#include <optional>
 #include <ranges>
+#include <set>
+#include <string>
+#include <thread>
+
+// --base-url <url> (e.g. of ai_mock) / --batch <n> times an interactive send next to n background ones /
+// --scheduler checks the scheduler offline, the capture and hedging flags are in test_common.h
+
+void print_metrics(const ai::thread &thread)
+{
+    auto ms = [](std::chrono::microseconds t) { return std::chrono::duration<double, std::milli>(t); };
+    for (auto &message : thread.get_messages())
+    {
+        auto &m = message.metrics;
+        std::print(std::cerr, "{}: queued {}, dns {}, connect {}, tls {}, upload {}, first byte {}, created {}, first delta {}, "
+                              "{} deltas (mean gap {}, max {}), total {}, {} B out, {} B in{}{}{}\n",
+                   message.id, ms(m.queued), ms(m.dns), ms(m.connect), ms(m.tls), ms(m.upload), ms(m.first_byte), ms(m.created), ms(m.first_delta),
+                   m.deltas, ms(m.mean_gap), ms(m.max_gap), ms(m.total), m.bytes_out, m.bytes_in,
+                   m.reused ? ", reused" : "", m.hedged ? ", hedged" : "", m.cached ? ", cached" : "");
+        auto &u = message.usage;
+        std::print(std::cerr, "    {} input ({} cached), {} output ({} reasoning), {:.1f} tokens/s\n",
+                   u.input, u.cached, u.output, u.reasoning, u.output_per_second(m));
+    }
+}
+
+// token totals of everything in the database
+void usage_report()
+{
+    ai::database db("database");
+    auto print = [](std::string_view title, const auto &totals) {
+        std::print("{}:\n", title);
+        for (auto &[name, t] : totals)
+            std::print("    {}: {} responses, {} input ({:.0f}% cached), {} output ({} reasoning), {:.1f} tokens/s\n",
+                       name, t.responses, t.tokens.input, t.cached_share() * 100, t.tokens.output, t.tokens.reasoning, t.output_per_second());
+    };
+    print("By assistant", db.usage_by_assistant());
+    print("By model", db.usage_by_model());
+}
 
 void print_error(ai::severity_t severity, std::string_view message)
 {
@@ -18,12 +63,14 @@ void text_test(ai::handle &client)
     });
     auto assistant = ai::assistant::make(client, "test", "You have no purpose outside of API endpoint testing", "gpt-4o-mini");
     auto thread = ai::thread::make(*assistant);
+    prepare(*thread);
     thread->send("Testing!", *res);
     thread->send("What did I just say?", *res);
 
     ai::database db("database", false);
     if (auto r = db.append(*thread); !r)
         std::print(std::cerr, "Failed to append thread: {}\n", r.error());
+    print_metrics(*thread);
 }
 
 void json_test(ai::handle &client)
@@ -60,12 +107,261 @@ void json_test(ai::handle &client)
         }}
     }}});
     auto thread = ai::thread::make(*assistant);
+    prepare(*thread);
     // thread.send("Testing!", res);
     thread->send("Give me something to shatter my json parser?", *res);
 
     ai::database db("database", false);
     if (auto r = db.append(*thread); !r)
         std::print(std::cerr, "Failed to append thread: {}\n", r.error());
+    print_metrics(*thread);
+}
+
+// two dependent sends as one coroutine, resumed by the client's reactor instead of a thread per send
+ai::task<> async_flow(ai::thread &thread)
+{
+    auto stream = ai::async_stream::make(thread, "Testing!");
+    while (auto delta = co_await stream->next())
+    {
+        std::print("{}", *delta);
+        std::cout.flush();
+    }
+    auto first = co_await stream->message();
+    std::print("\n({})\n", first.id);
+
+    auto second = co_await ai::send_async(thread, "What did I just say?");
+    std::print("{}\n({})\n", second.response, second.id);
+
+    // resumed on the reactor by now, where only the non-blocking upload may run
+    auto image = co_await ai::make_file_async(thread.get_assistant().client(), "assets/tool_test.jpg", ai::file::mode::upload);
+    ai::input_content content(2);
+    content.append("What is in this image?");
+    content.append(std::move(image));
+    ai::input_t input(1);
+    input.append(ai::input_t::role::user, std::move(content));
+    auto third = co_await ai::send_async(thread, input);
+    std::print("{}\n({})\n", third.response, third.id);
+}
+
+void async_test(ai::handle &client)
+{
+    auto assistant = ai::assistant::make(client, "test", "You have no purpose outside of API endpoint testing", "gpt-4o-mini");
+    auto thread = ai::thread::make(*assistant);
+    prepare(*thread);
+    ai::sync_wait(async_flow(*thread));
+
+    ai::database db("database", false);
+    if (auto r = db.append(*thread); !r)
+        std::print(std::cerr, "Failed to append thread: {}\n", r.error());
+}
+
+// cancels a long answer after the first delta and checks that the partial text is kept
+void cancel_test(ai::handle &client)
+{
+    std::atomic<ai::thread *> running = nullptr;
+    std::chrono::steady_clock::time_point cancelled_at;
+    auto res = ai::text_stream_handler::make({
+        .delta = [&](std::string_view accum, std::string_view delta) {
+            std::print("{}", delta);
+            std::cout.flush();
+            if (auto th = running.exchange(nullptr))
+            {
+                cancelled_at = std::chrono::steady_clock::now();
+                th->cancel();
+            }
+        },
+        .error = print_error
+    });
+    auto assistant = ai::assistant::make(client, "test", "You have no purpose outside of API endpoint testing", "gpt-4o-mini");
+    auto thread = ai::thread::make(*assistant);
+    prepare(*thread);
+
+    running = thread.get();
+    thread->send("Count from 1 to 500, one number per line.", *res);
+    thread->join();
+    auto took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - cancelled_at);
+
+    if (thread->get_messages().empty())
+        std::print(std::cerr, "\nCancelled before the response started ({} after cancel)\n", took);
+    else
+    {
+        auto &message = thread->get_messages().back();
+        std::print(std::cerr, "\nCancelled {} after cancel, truncated {}, kept {} bytes\n", took, message.truncated, message.response.size());
+    }
+}
+
+// time to the first delta of an interactive send alone, and while a batch of background sends runs
+void batch_test(ai::handle &client, std::size_t batch)
+{
+    auto assistant = ai::assistant::make(client, "test", "You have no purpose outside of API endpoint testing", "gpt-4o-mini");
+    auto first_delta = [&]() {
+        std::chrono::steady_clock::time_point first{};
+        auto res = ai::text_stream_handler::make({
+            .delta = [&](std::string_view accum, std::string_view delta) {
+                if (first == std::chrono::steady_clock::time_point{})
+                    first = std::chrono::steady_clock::now();
+            },
+            .error = print_error
+        });
+        auto thread = ai::thread::make(*assistant);
+        prepare(*thread);
+
+        auto start = std::chrono::steady_clock::now();
+        thread->send("Say hi.", *res);
+        thread->join();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(first - start);
+    };
+
+    auto alone = first_delta();
+
+    std::vector<std::pair<ai::thread::handle_t, ai::text_stream_handler::handle_t>> threads;
+    for (std::size_t i = 0; i < batch; ++i)
+    {
+        auto &[thread, res] = threads.emplace_back(ai::thread::make(*assistant), ai::text_stream_handler::make({
+            .delta = [](std::string_view accum, std::string_view delta) {},
+            .error = print_error
+        }));
+        thread->set_priority(ai::priority::background);
+        thread->send("Count from 1 to 200, one number per line.", *res);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    auto busy = first_delta();
+    for (auto &[thread, res] : threads)
+        thread->join();
+
+    std::print(std::cerr, "Time to first delta: alone {}, next to {} background sends {}\n", alone, batch, busy);
+}
+
+// time to the first delta on a cold client, and on one warmed up while the prompt is typed
+void warm_test()
+{
+    auto first_delta = [](bool warm) {
+        auto client = ai::handle::make();
+        if (warm)
+        {
+            client->warm_up();
+            std::this_thread::sleep_for(std::chrono::seconds(2));
+        }
+
+        std::chrono::steady_clock::time_point first{};
+        auto res = ai::text_stream_handler::make({
+            .delta = [&](std::string_view accum, std::string_view delta) {
+                if (first == std::chrono::steady_clock::time_point{})
+                    first = std::chrono::steady_clock::now();
+            },
+            .error = print_error
+        });
+        auto assistant = ai::assistant::make(*client, "test", "You have no purpose outside of API endpoint testing", "gpt-4o-mini");
+        auto thread = ai::thread::make(*assistant);
+
+        auto start = std::chrono::steady_clock::now();
+        thread->send("Say hi.", *res);
+        thread->join();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(first - start);
+    };
+
+    auto cold = first_delta(false);
+    auto warm = first_delta(true);
+    std::print(std::cerr, "Time to first delta: cold {}, warmed up {} ({} saved)\n", cold, warm, cold - warm);
+}
+
+// The scheduler's rules, checked without the network: the concurrency of each class, interactive requests
+// holding the others back until their response starts, exempt requests and promotion with set_priority.
+// Returns whether all of them held.
+bool scheduler_test()
+{
+    ai::detail::reactor reactor;
+    ai::schedule_policy policy{.concurrency = {2, 1, 2}};
+    ai::detail::scheduler scheduler(reactor, policy);
+
+    // reactor thread only, read once sync returned
+    std::set<std::string> started, paused;
+    auto submit = [&](std::string name, ai::priority p, bool exempt = false) {
+        ai::detail::scheduler::pause_fun_t pause;
+        if (!exempt) // exempt requests, deletes, have nothing to pause
+            pause = [&paused, name](bool pause) {
+                if (pause)
+                    paused.insert(name);
+                else
+                    paused.erase(name);
+            };
+        return scheduler.submit(p, [&started, name](auto) { started.insert(name); }, std::move(pause), exempt);
+    };
+    // every scheduler call is queued on the reactor, a task queued after them runs once they did
+    auto sync = [&reactor] {
+        std::promise<void> done;
+        reactor.post([&done] { done.set_value(); });
+        done.get_future().wait();
+    };
+    // a request finished while paused is no longer paused
+    auto finish = [&](ai::detail::scheduler::id_t id, const std::string &name) {
+        sync();
+        paused.erase(name);
+        scheduler.finished(id);
+    };
+
+    std::size_t failures = 0;
+    auto check = [&](bool ok, std::string_view what) {
+        std::print(std::cerr, "Scheduler: {}: {}\n", what, ok ? "ok" : "FAILED");
+        failures += !ok;
+    };
+
+    auto bg1 = submit("bg1", ai::priority::background);
+    auto bg2 = submit("bg2", ai::priority::background);
+    auto bg3 = submit("bg3", ai::priority::background);
+    sync();
+    check(started == std::set<std::string>{"bg1", "bg2"}, "background requests run two at a time");
+
+    auto in1 = submit("in1", ai::priority::interactive);
+    sync();
+    check(started.contains("in1") && paused == std::set<std::string>{"bg1", "bg2"}, "an interactive request pauses the others");
+
+    finish(bg1, "bg1");
+    sync();
+    check(!started.contains("bg3"), "nothing else starts while it waits for its response");
+
+    scheduler.settled(in1);
+    sync();
+    check(paused.empty() && started.contains("bg3"), "its response started, the others resume and start");
+
+    finish(bg3, "bg3");
+    auto in2 = submit("in2", ai::priority::interactive);
+    auto del = submit("del", ai::priority::background, true);
+    auto pf = submit("pf", ai::priority::prefetch);
+    sync();
+    check(paused == std::set<std::string>{"bg2"} && started.contains("del") && !started.contains("pf"), "exempt requests start while the others are held");
+
+    finish(in2, "in2");
+    sync();
+    check(paused.empty() && started.contains("pf"), "an interactive request that finished without a response lets go");
+
+    auto in3 = submit("in3", ai::priority::interactive);
+    sync();
+    check(paused == std::set<std::string>{"bg2", "pf"}, "a second interactive request pauses them again");
+
+    scheduler.set_priority(pf, ai::priority::interactive);
+    scheduler.settled(in3);
+    sync();
+    check(paused == std::set<std::string>{"bg2"}, "a promoted request resumes and holds the others until its response");
+
+    auto in4 = submit("in4", ai::priority::interactive);
+    scheduler.settled(pf);
+    sync();
+    check(!started.contains("in4") && paused.empty(), "interactive requests over their concurrency wait");
+
+    finish(in1, "in1");
+    finish(in3, "in3");
+    sync();
+    check(started.contains("in4") && paused == std::set<std::string>{"bg2"}, "the waiting one starts once a slot is free");
+
+    auto stats = scheduler.stats();
+    check(stats[std::size_t(ai::priority::background)].preempted == 5 && stats[std::size_t(ai::priority::prefetch)].preempted == 1, "preemptions are counted");
+
+    for (auto &[id, name] : {std::pair{bg2, "bg2"}, {del, "del"}, {pf, "pf"}, {in4, "in4"}})
+        finish(id, name);
+    sync();
+    return failures == 0;
 }
 
 template <std::ranges::range R>
@@ -82,6 +378,7 @@ void conversation(ai::handle &client, R &&tools)
 
     std::print("Tools: {}\n", tools);
     auto thread = ai::thread::make(*assistant);
+    prepare(*thread);
     // thread.send("Testing!", res);
     while (true)
     {
@@ -106,14 +403,59 @@ int main(int argc, char *argv[])
     try
     {
         auto args = std::ranges::subrange(argv + 1, argv + argc) | std::views::transform([](auto &&arg) { return std::string_view(arg); });
-        auto client = ai::handle::make();
+
+        if (std::ranges::contains(args, "--usage"))
+        {
+            usage_report();
+            return 0;
+        }
+        if (std::ranges::contains(args, "--scheduler"))
+            return scheduler_test() ? 0 : 1;
+
+        capture_args.record = arg_value(args, "--record");
+        capture_args.replay = arg_value(args, "--replay");
+        capture_args.paced = std::ranges::contains(args, "--paced");
+        capture_args.hedge = arg_value(args, "--hedge");
+        capture_args.cache = arg_value(args, "--cache");
+
+        // replays never touch the network, so they don't need a key
+        auto base_url = arg_value(args, "--base-url");
+        auto client = capture_args.replay ? ai::handle::make("replay") : base_url ? ai::handle::make("mock") : ai::handle::make();
+        if (base_url)
+            client->set_base_url(std::string(*base_url));
+        if (capture_args.cache)
+            if (auto r = client->set_cache({.dir = *capture_args.cache, .paced = capture_args.paced}); !r)
+                std::print(std::cerr, "Failed to open cache: {}\n", r.error());
         if (std::ranges::contains(args, "--json"))
             json_test(*client);
+        else if (std::ranges::contains(args, "--async"))
+            async_test(*client);
+        else if (std::ranges::contains(args, "--cancel"))
+            cancel_test(*client);
+        else if (std::ranges::contains(args, "--warm"))
+            warm_test();
+        else if (auto batch = arg_value(args, "--batch"))
+            batch_test(*client, std::stoul(std::string(*batch)));
         else if (std::ranges::contains(args, "--conversation"))
-            conversation(*client, args | std::views::filter([](auto &&arg) { return arg != "--conversation"; }));
+        {
+            // everything else is a tool
+            std::vector<std::string_view> tools;
+            for (auto it = args.begin(); it != args.end(); ++it)
+            {
+                if (*it == "--record" || *it == "--replay" || *it == "--hedge" || *it == "--cache" || *it == "--base-url" || *it == "--batch")
+                {
+                    if (std::ranges::next(it) != args.end())
+                        ++it;
+                }
+                else if (*it != "--conversation" && *it != "--paced")
+                    tools.push_back(*it);
+            }
+            conversation(*client, tools);
+        }
         else
             text_test(*client);
 
+        print_pool(*client);
         return 0;
     }
     catch(const std::exception &e)
@@ -0,0 +1,71 @@
+#pragma once
+#include "ai.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <optional>
+#include <print>
+#include <ranges>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// What ai_test and tool_test share: the capture and hedging flags every thread is prepared with, and the
+// client's statistics printed at the end.
+
+// --record <file> / --replay <file> [--paced] / --hedge <ms> / --cache <dir>, each target reads the ones it takes
+struct capture_args_t
+{
+    std::optional<std::string_view> record;
+    std::optional<std::string_view> replay;
+    bool paced = false;
+    std::optional<std::string_view> hedge; // --hedge <ms>, 0 for the rolling p90
+    std::optional<std::string_view> cache;
+};
+
+inline capture_args_t capture_args;
+
+inline void prepare(ai::thread &thread)
+{
+    if (capture_args.hedge)
+        thread.set_hedging({.enabled = true, .budget = std::chrono::milliseconds(std::stoi(std::string(*capture_args.hedge)))});
+    if (capture_args.record)
+        thread.record(*capture_args.record);
+    if (capture_args.replay)
+        if (auto r = thread.replay(*capture_args.replay, capture_args.paced); !r)
+            throw std::runtime_error(r.error());
+}
+
+inline std::optional<std::string_view> arg_value(auto &&args, std::string_view flag)
+{
+    auto it = std::ranges::find(args, flag);
+    if (it == std::ranges::end(args) || std::ranges::next(it) == std::ranges::end(args))
+        return std::nullopt;
+    return *std::ranges::next(it);
+}
+
+inline void print_pool(ai::handle &client)
+{
+    auto stats = client.pool_stats();
+    std::print(std::cerr, "Pool: {} requests, {} new connections ({} handshake), {} handles reused, {} created\n",
+               stats.requests, stats.connections, std::chrono::duration_cast<std::chrono::milliseconds>(stats.handshake), stats.hits, stats.misses);
+
+    auto hedges = client.hedge_stats();
+    if (hedges.hedges)
+        std::print(std::cerr, "Hedging: {} hedges, {} won, {} saved, p90 to first text {}\n",
+                   hedges.hedges, hedges.wins, std::chrono::duration_cast<std::chrono::milliseconds>(hedges.saved), std::chrono::duration_cast<std::chrono::milliseconds>(hedges.p90));
+
+    auto limits = client.rate_limit_stats();
+    if (limits.delayed || limits.rejected || limits.retries)
+        std::print(std::cerr, "Rate limits: {} sends delayed ({} in total), {} rejected, {} retries\n",
+                   limits.delayed, limits.delay, limits.rejected, limits.retries);
+
+    constexpr std::array names{"interactive", "prefetch", "background"};
+    auto classes = client.scheduler_stats();
+    for (std::size_t i = 0; i < classes.size(); ++i)
+        if (auto &c = classes[i]; c.started)
+            std::print(std::cerr, "Scheduled {}: {} started, {} queued at most, waited {} on average ({} at most), {} preempted\n",
+                       names[i], c.started, c.max_queued, std::chrono::duration_cast<std::chrono::milliseconds>(c.mean_wait()),
+                       std::chrono::duration_cast<std::chrono::milliseconds>(c.max_wait), c.preempted);
+}
@@ -1,15 +1,32 @@
 #include "ai.h"
 #include "database.h"
+#include "test_common.h"
 #include "tools.h"
 #include <print>
 #include <iostream>
+#include <optional>
 #include <string_view>
 
+// screenshots are uploaded, which replays have to do without
+std::expected<std::vector<ai::file::handle_t>, std::string> attachments(ai::handle &client)
+{
+    std::vector<ai::file::handle_t> res;
+    if (capture_args.replay)
+        return res;
+
+    auto file = ai::file::make(client, "assets/tool_test.jpg");
+    if (!file)
+        return std::unexpected(std::format("Failed to open file: {}", file.error()));
+    res.push_back(*std::move(file));
+    return res;
+}
+
 std::expected<ai::thread::handle_t, std::string> reword(ai::handle &client)
 {
     ai::reworder reworder(client);
 
     auto thread = reworder.start_thread();
+    prepare(*thread);
     auto res = ai::json_stream_handler::make({
         .delta = [](const nlohmann::json &accum) {
             std::print("\033[2J\033[H");
@@ -21,11 +38,11 @@ std::expected<ai::thread::handle_t, std::string> reword(ai::handle &client)
         }
     });
 
-    auto file = ai::file::make(client, "assets/tool_test.jpg");
-    if (!file)
-        return std::unexpected(std::format("Failed to open file: {}", file.error()));
+    auto files = attachments(client);
+    if (!files)
+        return std::unexpected(files.error());
     auto text = "This is a paragraph that is not written very well. It has a lot of issues, like grammar problems and unclear ideas, and it doesn't really make sense. I think it could be improved a lot if someone could help make it better and easier to understand.";
-    if (auto err = reworder.initial_send(*thread, *res, std::views::single(*std::move(file)), {}, text); !err)
+    if (auto err = reworder.initial_send(*thread, *res, *files, {}, text); !err)
         return std::unexpected(std::format("Failed to send request: {}", err.error()));
     
     return thread;
@@ -36,6 +53,7 @@ std::expected<ai::thread::handle_t, std::string> ask(ai::handle &client)
     ai::ask ask(client);
 
     auto thread = ask.start_thread();
+    prepare(*thread);
     auto res = ai::text_stream_handler::make({
         .delta = [](std::string_view accum, std::string_view delta) {
             std::print("{}", delta);
@@ -47,10 +65,10 @@ std::expected<ai::thread::handle_t, std::string> ask(ai::handle &client)
         }
     });
     
-    auto file = ai::file::make(client, "assets/tool_test.jpg");
-    if (!file)
-        return std::unexpected(std::format("Failed to open file: {}", file.error()));
-    if (auto err = ask.initial_send(*thread, *res, std::views::single(*file), "How do I change the theme? What are some good modern themes to use? Use the internet to find themes."); !err)
+    auto files = attachments(client);
+    if (!files)
+        return std::unexpected(files.error());
+    if (auto err = ask.initial_send(*thread, *res, *files, "How do I change the theme? What are some good modern themes to use? Use the internet to find themes."); !err)
         return std::unexpected(std::format("Failed to send request: {}", err.error()));
     
     return thread;
@@ -61,8 +79,13 @@ int main(int argc, char *argv[])
     try
     {
         auto args = std::ranges::subrange(argv + 1, argv + argc) | std::views::transform([](auto &&arg) { return std::string_view(arg); });
-        
-        auto client = ai::handle::make();
+
+        capture_args.record = arg_value(args, "--record");
+        capture_args.replay = arg_value(args, "--replay");
+        capture_args.paced = std::ranges::contains(args, "--paced");
+
+        // replays never touch the network, so they don't need a key
+        auto client = capture_args.replay ? ai::handle::make("replay") : ai::handle::make();
         
         std::expected<ai::thread::handle_t, std::string> res;
         if (std::ranges::contains(args, "--reword"))
@@ -82,6 +105,7 @@ int main(int argc, char *argv[])
         if (auto r = db.append(**res); !r)
             std::print(std::cerr, "Failed to append thread: {}\n", r.error());
 
+        print_pool(*client);
         return 0;
     }
     catch(const std::exception &e)
@@ -1,18 +1,35 @@
 #pragma once
 #include "ai.h"
+#include "cache.h"
 #include "database.h"
 #include "tools.h"
+#include "speculation.h"
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <print>
 
 class ai_handler
 {
 public:
     static constexpr std::string_view database_dir = "database";
+    // deltas are coalesced to about one repaint per frame
+    static constexpr std::chrono::milliseconds flush_interval{16};
+    // ids of uploaded files not deleted yet, swept on startup after a crash
+    static constexpr std::string_view upload_journal = "uploads.journal";
+    // responses of cacheable tools, re-running Reword on the same text is answered from here
+    static constexpr std::string_view response_cache = "responses";
     ai_handler() :
         M_db(database_dir),
         M_handle(ai::handle::make()),
         M_reworder(*M_handle),
         M_ask(*M_handle)
     {
+        if (auto res = M_handle->deletions().set_journal(std::filesystem::path(database_dir) / upload_journal); !res)
+            std::print(std::cerr, "{}\n", res.error());
+        if (auto res = M_handle->set_cache({.dir = std::filesystem::path(database_dir) / response_cache}); !res)
+            std::print(std::cerr, "{}\n", res.error());
     }
 
     auto &client()
@@ -35,10 +52,57 @@ public:
         return M_db;
     }
 
+    // starts rewording selected in the background, in case the user picks Reword without a prompt
+    void speculate_reword(std::string selected, ai::file::handle_t window)
+    {
+        drop_reword();
+        M_speculation = std::make_unique<reword_speculation>(M_reworder, std::move(selected), std::move(window), flush_interval);
+        ++M_speculations;
+    }
+
+    // the running speculation if it sends what reword would send with these inputs, null (and cancelled) otherwise
+    reword_speculation::handle_t claim_reword(std::string_view selected, std::string_view prompt, bool with_window, bool with_screen)
+    {
+        if (!M_speculation || !M_speculation->matches(selected, prompt, with_window, with_screen))
+        {
+            drop_reword();
+            return nullptr;
+        }
+
+        ++M_speculation_hits;
+        return std::move(M_speculation);
+    }
+
+    // counts what a claimed speculation saved, once it is attached (and reports it in debug builds)
+    void speculation_used(const reword_speculation &speculation)
+    {
+        auto saved = speculation.head_start();
+        M_speculation_saved += saved;
+#ifndef NDEBUG
+        std::print(std::cerr, "Speculative reword hit, {} saved ({} of {} hit, {} saved in total)\n", saved, M_speculation_hits, M_speculations, M_speculation_saved);
+#endif
+    }
+
+    // cancels a speculation nobody claimed
+    void drop_reword()
+    {
+        if (!M_speculation)
+            return;
+
+        M_speculation.reset();
+#ifndef NDEBUG
+        std::print(std::cerr, "Speculative reword missed ({} of {} hit)\n", M_speculation_hits, M_speculations);
+#endif
+    }
 
 private:
     ai::database M_db;
     ai::handle::handle_t M_handle;
     ai::reworder M_reworder;
     ai::ask M_ask;
+
+    reword_speculation::handle_t M_speculation;
+    std::size_t M_speculations = 0;
+    std::size_t M_speculation_hits = 0;
+    std::chrono::milliseconds M_speculation_saved{};
 };
\ No newline at end of file
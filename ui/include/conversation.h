@@ -34,7 +34,7 @@ public slots:
     void add_bubble(std::string_view text, bool parse_math = false, const QDateTime &time = QDateTime::currentDateTime());
     void send();
 private:
-    void delta(std::string accum, std::string delta);
+    void delta(ai::text_snapshot accum, std::string delta);
     void finish(std::string accum);
     void error(ai::severity_t severity, std::string msg);
 
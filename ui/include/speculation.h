@@ -0,0 +1,58 @@
+#pragma once
+#include "ai.h"
+#include "tools.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// A reword of the selected text, started when the prompt window opens and before a tool is picked. If the user
+// then sends Reword unchanged, the reword window takes it over and shows what already arrived; otherwise it is
+// cancelled.
+class reword_speculation
+{
+public:
+    using handle_t = std::unique_ptr<reword_speculation>;
+
+    // the focused window is attached as reword attaches it by default, whenever there is one
+    reword_speculation(ai::reworder &tool, std::string selected, ai::file::handle_t window, std::chrono::milliseconds coalescing);
+    reword_speculation(const reword_speculation &) = delete;
+    reword_speculation &operator=(const reword_speculation &) = delete;
+    // cancels the request unless it was attached
+    ~reword_speculation();
+
+    // whether reword with these inputs would send the same request
+    bool matches(std::string_view selected, std::string_view prompt, bool with_window, bool with_screen) const;
+
+    auto &thread() const { return M_thread; }
+    auto &stream_handler() const { return M_handler; }
+
+    // Routes the response to delta and finish from now on, after replaying what arrived so far on the calling thread.
+    void attach(ai::json_stream_handler::delta_fun_t delta, ai::json_stream_handler::finish_fun_t finish);
+
+    // how long the request had been running when it was attached, at most until it finished
+    std::chrono::milliseconds head_start() const;
+private:
+    // shared with the handler's callbacks, which run on the reactor thread
+    struct target
+    {
+        std::mutex mutex;
+        ai::json_stream_handler::delta_fun_t delta;
+        ai::json_stream_handler::finish_fun_t finish;
+        std::optional<nlohmann::json> accum; // the latest, until attached
+        bool finished = false;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point finished_at;
+        std::chrono::steady_clock::time_point attached_at;
+    };
+
+    std::string M_selected;
+    bool M_with_window;
+    std::shared_ptr<target> M_target;
+    ai::thread::handle_t M_thread;
+    ai::json_stream_handler::handle_t M_handler;
+    bool M_attached = false;
+};
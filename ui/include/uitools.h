@@ -101,6 +101,8 @@ signals:
 protected:
     void closeEvent(QCloseEvent *event) override
     {
+        // nobody reads the rest, stop paying for it instead of waiting for it in finish
+        M_thread->cancel();
         finish();
         QWidget::closeEvent(event);
     }
@@ -118,11 +120,13 @@ class reword_window : public ui_tool
 {
     Q_OBJECT
 public:
-    explicit reword_window(ai_handler &ai, window_handler &handler, context &&ctx, std::string_view prompt);
+    // continues speculation instead of sending when given one
+    explicit reword_window(ai_handler &ai, window_handler &handler, context &&ctx, std::string_view prompt, reword_speculation::handle_t speculation = nullptr);
     ~reword_window();
 private:
     std::unique_ptr<Ui::Reword> ui;
     ai::json_stream_handler::handle_t M_stream_handler;
+    reword_speculation::handle_t M_speculation;
 
     void on_delta(const nlohmann::json &accum);
     void on_finish(const nlohmann::json &accum);
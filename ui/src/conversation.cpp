@@ -46,9 +46,31 @@ public:
 
     void setContent(std::string_view text)
     {
-        setMarkdown(QString::fromStdString(std::string(text)));
-        updateGeometry();
-        setFixedHeight(document()->size().height() + padding * 2);
+        markdown = QString::fromUtf8(text.data(), text.size());
+        shown = text.size();
+        showMarkdown();
+    }
+
+    // Takes only what the snapshot holds past the text shown so far, the answer is never copied whole per delta.
+    // Snapshots end on delta boundaries, so the new part is complete UTF-8.
+    void appendContent(const ai::text_snapshot &accum)
+    {
+        if (accum.size() < shown)
+            return setContent(accum.str());
+
+        std::string suffix;
+        suffix.reserve(accum.size() - shown);
+        std::size_t offset = 0;
+        for (auto chunk : accum.chunks())
+        {
+            if (offset + chunk.size() > shown)
+                suffix.append(chunk.substr(shown > offset ? shown - offset : 0));
+            offset += chunk.size();
+        }
+
+        shown = accum.size();
+        markdown.append(QString::fromUtf8(suffix.data(), suffix.size()));
+        showMarkdown();
     }
 
     void setMathContent(std::string_view text)
@@ -168,7 +190,16 @@ protected:
     }
 
 private:
+    void showMarkdown()
+    {
+        setMarkdown(markdown);
+        updateGeometry();
+        setFixedHeight(document()->size().height() + padding * 2);
+    }
+
     bool user;
+    QString markdown;
+    std::size_t shown = 0; // bytes of the answer in markdown
 };
 
 auto make_callback(auto &&self, auto memfn)
@@ -209,10 +240,12 @@ conversation::conversation(ai_handler &ai, ai::thread &thread, QWidget *parent)
     }
 
     M_stream = ai::text_stream_handler::make(ai::text_stream_handler::constructor_arg_t{
-        .delta = make_callback(*this, std::mem_fn(&conversation::delta)),
         .finish = make_callback(*this, std::mem_fn(&conversation::finish)),
         .error = make_callback(*this, std::mem_fn(&conversation::error))
     });
+    // snapshots are queued to the ui thread as is, the answer is not copied per token
+    M_stream->set_shared_delta(make_callback(*this, std::mem_fn(&conversation::delta)));
+    M_stream->set_coalescing(ai_handler::flush_interval);
 
     connect(M_ui->Send, &QToolButton::clicked, this, &conversation::send);
 }
@@ -275,14 +308,14 @@ void conversation::send()
     }
 }
 
-void conversation::delta(std::string accum, std::string delta)
+void conversation::delta(ai::text_snapshot accum, std::string delta)
 {
     if (accum.empty())
         return;
 
     auto vbox = static_cast<QVBoxLayout*>(M_ui->MessagesContent->layout());
     auto bubble = static_cast<Bubble*>(vbox->itemAt(vbox->count() - 1)->widget());
-    bubble->setContent(accum);
+    bubble->appendContent(accum);
 }
 
 void conversation::finish(std::string accum)
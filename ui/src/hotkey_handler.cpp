@@ -71,6 +71,9 @@ void hotkey_handler::save_config()
 
 void hotkey_handler::make_prompt_window()
 {
+    // capturing the context and typing the prompt take long enough to have the connection ready by Send
+    M_ai->client().warm_up();
+
     context ctx;
     if (auto res = sys::window::get_focused())
     {
@@ -0,0 +1,81 @@
+#include "speculation.h"
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <print>
+
+reword_speculation::reword_speculation(ai::reworder &tool, std::string selected, ai::file::handle_t window, std::chrono::milliseconds coalescing) :
+    M_selected(std::move(selected)),
+    M_with_window(bool(window)),
+    M_target(std::make_shared<target>()),
+    M_thread(tool.start_thread())
+{
+    M_handler = ai::json_stream_handler::make({
+        .delta = [target = M_target](const nlohmann::json &accum) {
+            std::lock_guard lock(target->mutex);
+            if (target->delta)
+                target->delta(accum);
+            else
+                target->accum = accum;
+        },
+        .finish = [target = M_target](const nlohmann::json &accum) {
+            std::lock_guard lock(target->mutex);
+            target->finished_at = std::chrono::steady_clock::now();
+            if (target->finish)
+                target->finish(accum);
+            else
+            {
+                target->accum = accum;
+                target->finished = true;
+            }
+        }
+    });
+    M_handler->set_coalescing(coalescing);
+
+    // a guess, it must not hold up what the user actually sends
+    M_thread->set_priority(ai::priority::prefetch);
+
+    M_target->started = std::chrono::steady_clock::now();
+    if (auto res = tool.initial_send(*M_thread, *M_handler, std::array{std::move(window)}, {}, M_selected); !res)
+        std::print(std::cerr, "Failed to start speculative reword: {}\n", res.error());
+}
+
+reword_speculation::~reword_speculation()
+{
+    if (!M_attached)
+        M_thread->cancel();
+}
+
+bool reword_speculation::matches(std::string_view selected, std::string_view prompt, bool with_window, bool with_screen) const
+{
+    return selected == M_selected && prompt.empty() && with_window == M_with_window && !with_screen;
+}
+
+void reword_speculation::attach(ai::json_stream_handler::delta_fun_t delta, ai::json_stream_handler::finish_fun_t finish)
+{
+    std::lock_guard lock(M_target->mutex);
+    M_attached = true;
+    M_target->attached_at = std::chrono::steady_clock::now();
+    // now what the user waits on, the rest of the send and the follow-ups are interactive
+    M_thread->set_priority(ai::priority::interactive);
+
+    if (M_target->accum)
+    {
+        if (delta)
+            delta(*M_target->accum);
+        if (M_target->finished && finish)
+            finish(*M_target->accum);
+        M_target->accum.reset();
+    }
+
+    M_target->delta = std::move(delta);
+    M_target->finish = std::move(finish);
+}
+
+std::chrono::milliseconds reword_speculation::head_start() const
+{
+    std::lock_guard lock(M_target->mutex);
+    auto until = M_target->finished_at != std::chrono::steady_clock::time_point{} ? std::min(M_target->finished_at, M_target->attached_at) : M_target->attached_at;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(until - M_target->started);
+}
@@ -81,6 +81,20 @@ prompt_window::prompt_window(ai_handler &ai, window_handler &handler, context &&
     show();
     resizeEvent(nullptr);
 
+    // the selected text is often all reword needs, so its answer is on the way while the user decides
+    if (!M_context.selected_text.empty())
+    {
+        ai::file::handle_t window;
+        if (!M_context.window.empty())
+        {
+            if (auto res = ai::file::make(M_ai->client(), "window.jpg", M_context.window))
+                window = std::move(res).value();
+            else
+                std::print(std::cerr, "Failed to process window file: {}\n", res.error());
+        }
+        M_ai->speculate_reword(M_context.selected_text, std::move(window));
+    }
+
     connect(ui->ToolSelector, &QComboBox::currentTextChanged, this, &prompt_window::set_inclusions);
     set_inclusions(ui->ToolSelector->currentText());
 
@@ -102,9 +116,9 @@ prompt_window::prompt_window(ai_handler &ai, window_handler &handler, context &&
                 screen.clear();
         };
 
-        auto make = [&]<typename T>(std::type_identity<T>)
+        auto make = [&]<typename T>(std::type_identity<T>, auto &&...args)
         {
-            auto res = M_handler->create<T>(*M_ai, *M_handler, std::move(M_context), prompt.toStdString());
+            auto res = M_handler->create<T>(*M_ai, *M_handler, std::move(M_context), prompt.toStdString(), std::forward<decltype(args)>(args)...);
             res->setAttribute(Qt::WA_DeleteOnClose);
             res->setWindowFlag(Qt::WindowStaysOnTopHint);
             res->raise();
@@ -118,7 +132,8 @@ prompt_window::prompt_window(ai_handler &ai, window_handler &handler, context &&
                 return;
 
             setup();
-            make(std::type_identity<reword_window>{});
+            auto speculation = M_ai->claim_reword(M_context.selected_text, prompt.toStdString(), !window.empty(), !screen.empty());
+            make(std::type_identity<reword_window>{}, std::move(speculation));
         }
         else if (tool == "Create")
         {
@@ -236,7 +251,11 @@ void prompt_window::resizeEvent(QResizeEvent *event)
     setup_image(ui->ScreenScroll, ui->ScreenImage, M_screen_image);
 }
 
-prompt_window::~prompt_window() = default;
+prompt_window::~prompt_window()
+{
+    // closed without sending Reword, nobody will read the speculation
+    M_ai->drop_reword();
+}
 
 void ui_tool::finish()
 {
@@ -246,16 +265,18 @@ void ui_tool::finish()
     emit finished();
 }
 
-reword_window::reword_window(ai_handler &ai, window_handler &handler, context &&ctx, std::string_view prompt) :
+reword_window::reword_window(ai_handler &ai, window_handler &handler, context &&ctx, std::string_view prompt, reword_speculation::handle_t speculation) :
     ui_tool(ai.reworder(), ai, handler, std::move(ctx)),
     ui(new Ui::Reword),
     M_stream_handler(ai::json_stream_handler::make({
         .delta = std::bind(&reword_window::on_delta, this, std::placeholders::_1),
         .finish = std::bind(&reword_window::on_finish, this, std::placeholders::_1)
-    }))
+    })),
+    M_speculation(std::move(speculation))
 {   
     ui->setupUi(this);
     ui->PromptEdit->setText(QString::fromUtf8(prompt.data()));
+    M_stream_handler->set_coalescing(ai_handler::flush_interval);
 
     connect(ui->PromptEdit, &QLineEdit::returnPressed, ui->Send, &QToolButton::click);
     connect(ui->Send, &QToolButton::clicked, [this] { send(); } );
@@ -295,6 +316,17 @@ reword_window::reword_window(ai_handler &ai, window_handler &handler, context &&
             std::print(std::cerr, "Failed to copy text: {}\n", res.error());
     });
 
+    if (M_speculation)
+    {
+        // the request is already running, take over its thread and stream
+        M_thread = M_speculation->thread();
+        M_stream_handler = M_speculation->stream_handler();
+        M_speculation->attach(std::bind(&reword_window::on_delta, this, std::placeholders::_1),
+                              std::bind(&reword_window::on_finish, this, std::placeholders::_1));
+        M_ai->speculation_used(*M_speculation);
+        return;
+    }
+
     ai::file::handle_t window;
     if (!M_context.window.empty())
     {